@@ -0,0 +1,212 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// https://tools.ietf.org/html/rfc1071
+// The one's complement sum does not depend on the word size,
+// so words are summed in wide registers and folded to 16 bits at the end.
+// The vector lanes are 32 bits and are flushed before they can overflow.
+// Like csum_partial_copy, the words can be stored to a copy while summing,
+// so building a packet touches the payload only once.
+
+#define CHECKSUM_VECTOR 64 // bytes, shorter buffers are summed as scalars
+#define CHECKSUM_FLUSH 4096 // vector iterations
+
+typedef uint64_t (*sum_func)(uint64_t sum, uint8_t *copy, const uint8_t *buffer, size_t length);
+
+static sum_func sum_vector = NULL;
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+static uint64_t sum_scalar(uint64_t sum, uint8_t *copy, const uint8_t *buffer, size_t length) {
+    if (copy != NULL)
+        memcpy(copy, buffer, length);
+
+    uint64_t sum2 = 0;
+    uint64_t w1, w2;
+    while (length >= 16) {
+        memcpy(&w1, buffer, 8);
+        memcpy(&w2, buffer + 8, 8);
+        sum += (w1 & 0xFFFFFFFF) + (w1 >> 32);
+        sum2 += (w2 & 0xFFFFFFFF) + (w2 >> 32);
+        buffer += 16;
+        length -= 16;
+    }
+    sum += sum2;
+
+    if (length >= 8) {
+        memcpy(&w1, buffer, 8);
+        sum += (w1 & 0xFFFFFFFF) + (w1 >> 32);
+        buffer += 8;
+        length -= 8;
+    }
+    if (length >= 4) {
+        uint32_t w;
+        memcpy(&w, buffer, 4);
+        sum += w;
+        buffer += 4;
+        length -= 4;
+    }
+    if (length >= 2) {
+        uint16_t w;
+        memcpy(&w, buffer, 2);
+        sum += w;
+        buffer += 2;
+        length -= 2;
+    }
+    if (length > 0)
+        sum += *buffer;
+
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static uint64_t sum_sse2(uint64_t sum, uint8_t *copy, const uint8_t *buffer, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    while (length >= 32) {
+        __m128i acc = _mm_setzero_si128();
+        int n = 0;
+        while (length >= 32 && n++ < CHECKSUM_FLUSH) {
+            __m128i v1 = _mm_loadu_si128((const __m128i *) buffer);
+            __m128i v2 = _mm_loadu_si128((const __m128i *) (buffer + 16));
+            if (copy != NULL) {
+                _mm_storeu_si128((__m128i *) copy, v1);
+                _mm_storeu_si128((__m128i *) (copy + 16), v2);
+                copy += 32;
+            }
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v1, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v1, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v2, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v2, zero));
+            buffer += 32;
+            length -= 32;
+        }
+
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return sum_scalar(sum, copy, buffer, length);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(uint64_t sum, uint8_t *copy, const uint8_t *buffer, size_t length) {
+    const __m256i zero = _mm256_setzero_si256();
+    while (length >= 64) {
+        __m256i acc = _mm256_setzero_si256();
+        int n = 0;
+        while (length >= 64 && n++ < CHECKSUM_FLUSH) {
+            __m256i v1 = _mm256_loadu_si256((const __m256i *) buffer);
+            __m256i v2 = _mm256_loadu_si256((const __m256i *) (buffer + 32));
+            if (copy != NULL) {
+                _mm256_storeu_si256((__m256i *) copy, v1);
+                _mm256_storeu_si256((__m256i *) (copy + 32), v2);
+                copy += 64;
+            }
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v1, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v1, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v2, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v2, zero));
+            buffer += 64;
+            length -= 64;
+        }
+
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *) lanes, acc);
+        for (int i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+    return sum_scalar(sum, copy, buffer, length);
+}
+
+#elif defined(__ARM_NEON)
+
+static uint64_t sum_neon(uint64_t sum, uint8_t *copy, const uint8_t *buffer, size_t length) {
+    while (length >= 32) {
+        uint32x4_t acc = vdupq_n_u32(0);
+        int n = 0;
+        while (length >= 32 && n++ < CHECKSUM_FLUSH) {
+            uint16x8_t v1 = vld1q_u16((const uint16_t *) buffer);
+            uint16x8_t v2 = vld1q_u16((const uint16_t *) (buffer + 16));
+            if (copy != NULL) {
+                vst1q_u16((uint16_t *) copy, v1);
+                vst1q_u16((uint16_t *) (copy + 16), v2);
+                copy += 32;
+            }
+            acc = vpadalq_u16(acc, v1);
+            acc = vpadalq_u16(acc, v2);
+            buffer += 32;
+            length -= 32;
+        }
+
+        uint64x2_t wide = vpaddlq_u32(acc);
+        sum += vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+    }
+    return sum_scalar(sum, copy, buffer, length);
+}
+
+#endif
+
+static void init_checksum() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        sum_vector = sum_avx2;
+        log_android(ANDROID_LOG_INFO, "Checksum AVX2");
+    } else {
+        sum_vector = sum_sse2;
+        log_android(ANDROID_LOG_INFO, "Checksum SSE2");
+    }
+#elif defined(__ARM_NEON)
+    sum_vector = sum_neon;
+    log_android(ANDROID_LOG_INFO, "Checksum NEON");
+#else
+    sum_vector = sum_scalar;
+    log_android(ANDROID_LOG_INFO, "Checksum scalar");
+#endif
+}
+
+static uint16_t fold_checksum(uint64_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t) sum;
+}
+
+uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length) {
+    if (length < CHECKSUM_VECTOR)
+        return fold_checksum(sum_scalar(start, NULL, buffer, length));
+
+    pthread_once(&checksum_once, init_checksum);
+    return fold_checksum(sum_vector(start, NULL, buffer, length));
+}
+
+uint16_t copy_checksum(uint16_t start, uint8_t *dest, const uint8_t *src, size_t length) {
+    if (length < CHECKSUM_VECTOR)
+        return fold_checksum(sum_scalar(start, dest, src, length));
+
+    pthread_once(&checksum_once, init_checksum);
+    return fold_checksum(sum_vector(start, dest, src, length));
+}
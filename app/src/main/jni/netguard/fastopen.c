@@ -0,0 +1,125 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+// https://tools.ietf.org/html/rfc7413
+// Data an app sends with its SYN is sent upstream with the SYN too,
+// the kernel keeps the cookies and falls back to a plain connect without one.
+// Destinations which did not accept SYN data are remembered for a while,
+// so a middlebox dropping or stripping SYN data costs one connection only.
+// Apps get a cookie in the SYN-ACK, else they would never send SYN data.
+// Apps on the device cannot spoof addresses, so the cookie is not checked.
+
+struct fastopen_entry {
+    int version;
+    union {
+        __be32 ip4;
+        struct in6_addr ip6;
+    } daddr;
+    __be16 dest;
+    time_t failed; // 0 = SYN data accepted or not tried
+};
+
+static struct fastopen_entry fastopen_cache[TCP_FASTOPEN_CACHE];
+static pthread_mutex_t fastopen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t fastopen_cookie[TCP_FASTOPEN_COOKIE];
+static pthread_once_t fastopen_once = PTHREAD_ONCE_INIT;
+
+// Not from rand(), which also picks the local sequence numbers
+static void init_fastopen_cookie() {
+    ssize_t len = -1;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        len = read(fd, fastopen_cookie, TCP_FASTOPEN_COOKIE);
+        close(fd);
+    }
+
+    if (len != TCP_FASTOPEN_COOKIE) {
+        log_android(ANDROID_LOG_WARN, "Fast open cookie /dev/urandom error %d: %s",
+                    errno, strerror(errno));
+        for (int i = 0; i < TCP_FASTOPEN_COOKIE; i++)
+            fastopen_cookie[i] = (uint8_t) rand();
+    }
+}
+
+const uint8_t *get_fastopen_cookie() {
+    pthread_once(&fastopen_once, init_fastopen_cookie);
+    return fastopen_cookie;
+}
+
+static struct fastopen_entry *get_entry(const struct tcp_session *cur) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    const uint8_t *addr = (cur->version == 4
+                           ? (const uint8_t *) &cur->daddr.ip4
+                           : (const uint8_t *) &cur->daddr.ip6);
+    size_t len = (cur->version == 4 ? 4 : 16);
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ addr[i]) * 16777619u;
+    hash = (hash ^ (cur->dest & 0xFF)) * 16777619u;
+    hash = (hash ^ (cur->dest >> 8)) * 16777619u;
+    return &fastopen_cache[hash % TCP_FASTOPEN_CACHE];
+}
+
+static int is_entry(const struct fastopen_entry *e, const struct tcp_session *cur) {
+    return (e->version == cur->version && e->dest == cur->dest &&
+            (cur->version == 4
+             ? e->daddr.ip4 == cur->daddr.ip4
+             : memcmp(&e->daddr.ip6, &cur->daddr.ip6, 16) == 0));
+}
+
+// Returns 1 if SYN data may be sent to the destination of the session
+int check_fastopen(const struct tcp_session *cur) {
+    if (!TCP_SYN_DATA)
+        return 0;
+
+    if (pthread_mutex_lock(&fastopen_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
+    struct fastopen_entry *e = get_entry(cur);
+    int ok = (!is_entry(e, cur) || e->failed == 0 ||
+              time(NULL) - e->failed > TCP_FASTOPEN_BACKOFF);
+
+    if (pthread_mutex_unlock(&fastopen_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
+    return ok;
+}
+
+// Remember whether the destination accepted the SYN data
+void update_fastopen(const struct tcp_session *cur, int accepted) {
+    if (pthread_mutex_lock(&fastopen_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
+    struct fastopen_entry *e = get_entry(cur);
+    if (accepted) {
+        if (is_entry(e, cur))
+            e->failed = 0;
+    } else {
+        e->version = cur->version;
+        memcpy(&e->daddr, &cur->daddr, sizeof(e->daddr));
+        e->dest = cur->dest;
+        e->failed = time(NULL);
+    }
+
+    if (pthread_mutex_unlock(&fastopen_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
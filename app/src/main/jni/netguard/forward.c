@@ -0,0 +1,327 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+// TCP data from the tun is reassembled in a ring buffer per session.
+// Data is copied once to the offset of its sequence number,
+// the received ranges are kept in a small sorted array,
+// so overlapping data merges without copying queued data again.
+// Offsets are relative to the next byte to forward and below FORWARD_MAX.
+
+static uint32_t get_offset(const struct forward_queue *q, uint32_t seq) {
+    return seq - q->seq;
+}
+
+// First range ending at or after the offset
+static int find_range(const struct forward_queue *q, uint32_t offset) {
+    int lo = 0;
+    int hi = q->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (get_offset(q, q->range[mid].end) < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void reserve_forward(struct forward_queue *q, uint32_t size) {
+    if (q->data != NULL && size <= q->size)
+        return;
+
+    uint32_t grow = (q->data == NULL ? FORWARD_MIN : q->size);
+    while (grow < size)
+        grow <<= 1;
+
+    uint8_t *data = get_packet_buffer(grow, "forward queue");
+    if (q->data != NULL) {
+        // Unwrap
+        uint32_t first = q->size - q->head;
+        memcpy(data, q->data + q->head, first);
+        memcpy(data + first, q->data, q->head);
+        put_packet_buffer(q->data);
+    }
+
+    q->data = data;
+    q->size = grow;
+    q->head = 0;
+}
+
+static uint16_t copy_ring(struct forward_queue *q, uint32_t offset,
+                          const uint8_t *data, size_t len, uint16_t csum) {
+    uint32_t pos = (q->head + offset) & (q->size - 1);
+    size_t first = q->size - pos;
+    if (first > len)
+        first = len;
+
+    csum = copy_checksum(csum, q->data + pos, data, first);
+    if (first < len) {
+        // Data starting at an odd offset sums with swapped bytes
+        uint16_t rest = copy_checksum(0, q->data, data + first, len - first);
+        if (first & 1)
+            rest = (uint16_t) ((rest << 8) | (rest >> 8));
+        csum = calc_checksum(csum, (uint8_t *) &rest, 2);
+    }
+
+    return csum;
+}
+
+static void move_ring(struct forward_queue *q, uint32_t offset, const uint8_t *data, size_t len) {
+    uint32_t pos = (q->head + offset) & (q->size - 1);
+    size_t first = q->size - pos;
+    if (first > len)
+        first = len;
+
+    memcpy(q->data + pos, data, first);
+    memcpy(q->data, data + first, len - first);
+}
+
+// csum is the partial checksum of the pseudo header and the TCP header,
+// NULL if the data was checked already
+static int place_forward(struct forward_queue *q, uint32_t next, uint32_t seq,
+                         const uint8_t *data, size_t len, int psh, const uint16_t *csum) {
+    if (q->count == 0) {
+        q->seq = next;
+        q->head = 0;
+    }
+
+    // Skip data forwarded already
+    uint32_t skip = (compare_u32(seq, q->seq) < 0 ? q->seq - seq : 0);
+    if (skip >= len)
+        return 0;
+    uint32_t start = get_offset(q, seq + skip);
+    uint32_t end = get_offset(q, seq + (uint32_t) len);
+    if (end > FORWARD_MAX)
+        return 0;
+
+    // Find the ranges to merge with
+    int first = find_range(q, start);
+    int last = first;
+    int overlap = (skip > 0);
+    while (last < q->count && get_offset(q, q->range[last].start) <= end) {
+        if (get_offset(q, q->range[last].start) < end &&
+            get_offset(q, q->range[last].end) > start)
+            overlap = 1;
+        last++;
+    }
+    if (first == last && q->count == FORWARD_RANGES)
+        return 0;
+
+    reserve_forward(q, end);
+
+    // Data filling a hole is summed while copying,
+    // overlapping data is checked before it overwrites queued data
+    if (csum == NULL)
+        move_ring(q, start, data + skip, len - skip);
+    else if (overlap) {
+        if (calc_checksum(*csum, data, len) != 0xFFFF)
+            return -1;
+        move_ring(q, start, data + skip, len - skip);
+    } else if (copy_ring(q, start, data, len, *csum) != 0xFFFF)
+        return -1;
+
+    // Merge
+    uint32_t mstart = start;
+    uint32_t mend = end;
+    uint32_t merged = 0;
+    for (int i = first; i < last; i++) {
+        uint32_t rstart = get_offset(q, q->range[i].start);
+        uint32_t rend = get_offset(q, q->range[i].end);
+        if (rstart < mstart)
+            mstart = rstart;
+        if (rend > mend)
+            mend = rend;
+        merged += rend - rstart;
+    }
+
+    if (first == last) {
+        memmove(&q->range[first + 1], &q->range[first],
+                (q->count - first) * sizeof(struct forward_range));
+        q->count++;
+    } else if (last - first > 1) {
+        memmove(&q->range[first + 1], &q->range[last],
+                (q->count - last) * sizeof(struct forward_range));
+        q->count -= last - first - 1;
+    }
+    q->range[first].start = q->seq + mstart;
+    q->range[first].end = q->seq + mend;
+    q->buffered += (mend - mstart) - merged;
+
+    q->last = q->seq + end;
+
+    if (psh && (!q->pushed || get_offset(q, q->psh) < end)) {
+        q->psh = q->seq + end;
+        q->pushed = 1;
+    }
+
+    return 1;
+}
+
+// Returns 1 if queued, 0 if out of range and -1 if the checksum is invalid
+// csum is the partial checksum of the pseudo header and the TCP header
+int insert_forward(struct forward_queue *q, uint32_t next, uint32_t seq,
+                   const uint8_t *data, size_t len, int psh, uint16_t csum) {
+    return place_forward(q, next, seq, data, len, psh, &csum);
+}
+
+// Same, for data with a valid checksum
+int queue_forward(struct forward_queue *q, uint32_t next, uint32_t seq,
+                  const uint8_t *data, size_t len, int psh) {
+    return place_forward(q, next, seq, data, len, psh, NULL);
+}
+
+// Room for len bytes after the contiguous data at next, in two parts if it wraps around,
+// so data can be read straight into the queue
+int extend_forward(struct forward_queue *q, uint32_t next, uint32_t len, struct iovec *iov) {
+    if (q->count == 0) {
+        q->seq = next;
+        q->head = 0;
+    }
+
+    uint32_t start = (q->count > 0 ? get_offset(q, q->range[0].end) : 0);
+    reserve_forward(q, start + len);
+
+    uint32_t pos = (q->head + start) & (q->size - 1);
+    uint32_t first = q->size - pos;
+    iov[0].iov_base = q->data + pos;
+    if (len <= first) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = q->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+// Queue len bytes written to the room of extend_forward
+void append_forward(struct forward_queue *q, uint32_t len) {
+    if (q->count == 0) {
+        q->range[0].start = q->seq;
+        q->range[0].end = q->seq;
+        q->count = 1;
+    }
+    q->range[0].end += len;
+    q->buffered += len;
+    q->last = q->range[0].end;
+}
+
+// Bytes which can be forwarded when the next byte to forward is seq
+uint32_t get_forward_ready(const struct forward_queue *q, uint32_t seq) {
+    if (q->count == 0 || q->seq != seq || q->range[0].start != q->seq)
+        return 0;
+    return q->range[0].end - q->seq;
+}
+
+// Contiguous data, in two parts if it wraps around the end of the ring
+int peek_forward(const struct forward_queue *q, struct iovec *iov) {
+    if (q->count == 0 || q->range[0].start != q->seq)
+        return 0;
+
+    uint32_t len = q->range[0].end - q->seq;
+    uint32_t first = q->size - q->head;
+    iov[0].iov_base = q->data + q->head;
+    if (len <= first) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = q->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+// https://tools.ietf.org/html/rfc2018#section-4
+// The ranges after the first hole, the range with the data queued last first
+int get_forward_sack(const struct forward_queue *q, struct forward_range *block, int max) {
+    int first = (q->count > 0 && q->range[0].start == q->seq ? 1 : 0);
+    if (first >= q->count || max <= 0)
+        return 0;
+
+    int n = 0;
+    int last = find_range(q, get_offset(q, q->last));
+    if (last >= first && last < q->count &&
+        compare_u32(q->range[last].start, q->last) < 0)
+        block[n++] = q->range[last];
+    else
+        last = -1;
+
+    for (int i = first; i < q->count && n < max; i++)
+        if (i != last)
+            block[n++] = q->range[i];
+
+    return n;
+}
+
+// Like peek_forward, from seq on
+int read_forward(const struct forward_queue *q, uint32_t seq, struct iovec *iov) {
+    if (q->count == 0 || q->range[0].start != q->seq ||
+        compare_u32(seq, q->seq) < 0 || compare_u32(seq, q->range[0].end) >= 0)
+        return 0;
+
+    uint32_t offset = get_offset(q, seq);
+    uint32_t len = q->range[0].end - seq;
+    uint32_t pos = (q->head + offset) & (q->size - 1);
+    uint32_t first = q->size - pos;
+    iov[0].iov_base = q->data + pos;
+    if (len <= first) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = q->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+// Keeps the buffer when empty, for data which is queued again soon
+void release_forward(struct forward_queue *q, uint32_t len) {
+    q->seq += len;
+    q->head = (q->head + len) & (q->size - 1);
+    q->buffered -= len;
+    if (q->pushed && compare_u32(q->psh, q->seq) <= 0)
+        q->pushed = 0;
+
+    q->range[0].start += len;
+    if (q->range[0].start == q->range[0].end) {
+        q->count--;
+        memmove(&q->range[0], &q->range[1], q->count * sizeof(struct forward_range));
+    }
+}
+
+void consume_forward(struct forward_queue *q, uint32_t len) {
+    release_forward(q, len);
+    if (q->count == 0)
+        clear_forward(q);
+}
+
+void clear_forward(struct forward_queue *q) {
+    put_packet_buffer(q->data);
+    q->data = NULL;
+    q->size = 0;
+    q->head = 0;
+    q->buffered = 0;
+    q->pushed = 0;
+    q->count = 0;
+}
@@ -19,8 +19,6 @@
 
 #include "netguard.h"
 
-extern FILE *pcap_file;
-
 int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions) {
     int timeout = ICMP_TIMEOUT;
 
@@ -83,7 +81,7 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
             s->icmp.time = time(NULL);
 
             uint16_t blen = (uint16_t) (s->icmp.version == 4 ? ICMP4_MAXMSG : ICMP6_MAXMSG);
-            uint8_t *buffer = ng_malloc(blen, "icmp socket");
+            uint8_t *buffer = get_packet_buffer(blen, "icmp socket");
             ssize_t bytes = recv(s->socket, buffer, blen, 0);
             if (bytes < 0) {
                 // Socket error
@@ -136,16 +134,16 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
                 if (write_icmp(args, &s->icmp, buffer, (size_t) bytes) < 0)
                     s->icmp.stop = 1;
             }
-            ng_free(buffer, __FILE__, __LINE__);
+            put_packet_buffer(buffer);
         }
     }
 }
 
-jboolean handle_icmp(const struct arguments *args,
-                     const uint8_t *pkt, size_t length,
-                     const uint8_t *payload,
-                     int uid,
-                     const int epoll_fd) {
+struct ng_session *handle_icmp(const struct arguments *args,
+                               const uint8_t *pkt, size_t length,
+                               const uint8_t *payload,
+                               int uid,
+                               const int epoll_fd) {
     // Get headers
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -166,19 +164,18 @@ jboolean handle_icmp(const struct arguments *args,
     if (icmp->icmp_type != ICMP_ECHO) {
         log_android(ANDROID_LOG_WARN, "ICMP type %d code %d from %s to %s not supported",
                     icmp->icmp_type, icmp->icmp_code, source, dest);
-        return 0;
+        return NULL;
     }
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !((cur->protocol == IPPROTO_ICMP || cur->protocol == IPPROTO_ICMPV6) &&
-             !cur->icmp.stop && cur->icmp.version == version &&
-             (version == 4 ? cur->icmp.saddr.ip4 == ip4->saddr &&
-                             cur->icmp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->icmp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->icmp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args->ctx, (uint8_t) (version == 4 ? IPPROTO_ICMP : IPPROTO_ICMPV6), version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src, 0,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst, 0);
+
+    // Stopped sessions linger until cleanup, but are not reused
+    if (cur != NULL && cur->icmp.stop)
+        cur = NULL;
 
     // Create new session if needed
     if (cur == NULL) {
@@ -203,13 +200,12 @@ jboolean handle_icmp(const struct arguments *args,
         s->icmp.id = icmp->icmp_id; // store original ID
 
         s->icmp.stop = 0;
-        s->next = NULL;
 
         // Open UDP socket
         s->socket = open_icmp_socket(args, &s->icmp);
         if (s->socket < 0) {
             ng_free(s, __FILE__, __LINE__);
-            return 0;
+            return NULL;
         }
 
         log_android(ANDROID_LOG_DEBUG, "ICMP socket %d id %x", s->socket, s->icmp.id);
@@ -221,8 +217,7 @@ jboolean handle_icmp(const struct arguments *args,
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
             log_android(ANDROID_LOG_ERROR, "epoll add icmp error %d: %s", errno, strerror(errno));
 
-        s->next = args->ctx->ng_session;
-        args->ctx->ng_session = s;
+        add_session(args->ctx, s);
 
         cur = s;
     }
@@ -271,11 +266,11 @@ jboolean handle_icmp(const struct arguments *args,
         log_android(ANDROID_LOG_ERROR, "ICMP sendto error %d: %s", errno, strerror(errno));
         if (errno != EINTR && errno != EAGAIN) {
             cur->icmp.stop = 1;
-            return 0;
+            return cur;
         }
     }
 
-    return 1;
+    return cur;
 }
 
 int open_icmp_socket(const struct arguments *args, const struct icmp_session *cur) {
@@ -306,7 +301,7 @@ ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
     // Build packet
     if (cur->version == 4) {
         len = sizeof(struct iphdr) + datalen;
-        buffer = ng_malloc(len, "icmp write4");
+        buffer = get_packet_buffer(len, "icmp write4");
         struct iphdr *ip4 = (struct iphdr *) buffer;
         if (datalen)
             memcpy(buffer + sizeof(struct iphdr), data, datalen);
@@ -325,7 +320,7 @@ ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
         ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
     } else {
         len = sizeof(struct ip6_hdr) + datalen;
-        buffer = ng_malloc(len, "icmp write6");
+        buffer = get_packet_buffer(len, "icmp write6");
         struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
         if (datalen)
             memcpy(buffer + sizeof(struct ip6_hdr), data, datalen);
@@ -354,17 +349,10 @@ ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
                 args->tun, dest, source, datalen,
                 icmp->icmp_type, icmp->icmp_code, icmp->icmp_id, icmp->icmp_seq);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    // Write PCAP record
-    if (res >= 0) {
-        if (pcap_file != NULL)
-            write_pcap_rec(buffer, (size_t) res);
-    } else
+    ssize_t res = write_tun(args, buffer, len);
+    if (res < 0)
         log_android(ANDROID_LOG_WARN, "ICMP write error %d: %s", errno, strerror(errno));
 
-    ng_free(buffer, __FILE__, __LINE__);
-
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "write %d/%d", res, len);
         return -1;
@@ -53,14 +53,19 @@ int check_tun(const struct arguments *args,
 
     // Check tun read
     if (ev->events & EPOLLIN) {
-        uint8_t *buffer = ng_malloc(get_mtu(), "tun read");
+        uint8_t *buffer = get_packet_buffer(get_mtu(), "tun read");
         ssize_t length = read(args->tun, buffer, get_mtu());
+        args->ctx->syscalls++;
         if (length < 0) {
-            ng_free(buffer, __FILE__, __LINE__);
+            put_packet_buffer(buffer);
+
+            if (errno == EAGAIN)
+                // Drained
+                return 0;
 
             log_android(ANDROID_LOG_ERROR, "tun %d read error %d: %s",
                         args->tun, errno, strerror(errno));
-            if (errno == EINTR || errno == EAGAIN)
+            if (errno == EINTR)
                 // Retry later
                 return 0;
             else {
@@ -69,22 +74,14 @@ int check_tun(const struct arguments *args,
                 return -1;
             }
         } else if (length > 0) {
-            // Write pcap record
-            if (pcap_file != NULL)
-                write_pcap_rec(buffer, (size_t) length);
-
-            if (length > max_tun_msg) {
-                max_tun_msg = length;
-                log_android(ANDROID_LOG_WARN, "Maximum tun msg length %d", max_tun_msg);
-            }
-
-            // Handle IP from tun
-            handle_ip(args, buffer, (size_t) length, epoll_fd, sessions, maxsessions);
-
-            ng_free(buffer, __FILE__, __LINE__);
+            args->ctx->packets++;
+            int err = check_tun_packet(args, buffer, (size_t) length,
+                                       epoll_fd, sessions, maxsessions);
+            put_packet_buffer(buffer);
+            return (err < 0 ? -1 : 1);
         } else {
             // tun eof
-            ng_free(buffer, __FILE__, __LINE__);
+            put_packet_buffer(buffer);
 
             log_android(ANDROID_LOG_ERROR, "tun %d empty read", args->tun);
             report_exit(args, "tun %d empty read", args->tun);
@@ -95,6 +92,96 @@ int check_tun(const struct arguments *args,
     return 0;
 }
 
+int check_tun_packet(const struct arguments *args,
+                     const uint8_t *buffer, size_t length,
+                     const int epoll_fd,
+                     int sessions, int maxsessions) {
+    // Write pcap record
+    if (pcap_file != NULL)
+        write_pcap_rec(buffer, length);
+
+    if ((int) length > max_tun_msg) {
+        max_tun_msg = (int) length;
+        log_android(ANDROID_LOG_WARN, "Maximum tun msg length %d", max_tun_msg);
+    }
+
+    // Handle IP from tun
+    handle_ip(args, buffer, length, epoll_fd, sessions, maxsessions);
+    return 0;
+}
+
+ssize_t write_tun(const struct arguments *args, uint8_t *buffer, size_t len) {
+    args->ctx->written++;
+
+    // Written with the next flush
+    if (args->writer != NULL && queue_tun_write(args, args->writer, buffer, len) == 0) {
+        if (pcap_file != NULL)
+            write_pcap_rec(buffer, len);
+        return len;
+    }
+
+    ssize_t res = write(args->tun, buffer, len);
+    int err = errno;
+    args->ctx->write_syscalls++;
+
+    // Write pcap record
+    if (res >= 0 && pcap_file != NULL)
+        write_pcap_rec(buffer, (size_t) res);
+
+    put_packet_buffer(buffer);
+
+    errno = err;
+    return res;
+}
+
+void init_header_template(struct header_template *header, int version, uint8_t protocol,
+                          const void *saddr, __be16 source,
+                          const void *daddr, __be16 dest) {
+    memset(header, 0, sizeof(struct header_template));
+    uint16_t csum;
+    if (version == 4) {
+        struct iphdr *ip4 = (struct iphdr *) header->data;
+        ip4->version = 4;
+        ip4->ihl = sizeof(struct iphdr) >> 2;
+        ip4->ttl = IPDEFTTL;
+        ip4->protocol = protocol;
+        ip4->saddr = *((__be32 *) saddr);
+        ip4->daddr = *((__be32 *) daddr);
+        header->iplen = sizeof(struct iphdr);
+        header->ip_sum = calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
+
+        struct ippseudo pseudo;
+        memset(&pseudo, 0, sizeof(struct ippseudo));
+        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
+        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
+        pseudo.ippseudo_p = protocol;
+        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
+    } else {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *) header->data;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = protocol;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
+        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
+        memcpy(&(ip6->ip6_src), saddr, 16);
+        memcpy(&(ip6->ip6_dst), daddr, 16);
+        header->iplen = sizeof(struct ip6_hdr);
+
+        struct ip6_hdr_pseudo pseudo;
+        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
+        memcpy(&pseudo.ip6ph_src, saddr, 16);
+        memcpy(&pseudo.ip6ph_dst, daddr, 16);
+        pseudo.ip6ph_nxt = protocol;
+        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+    }
+
+    // Source and destination port are in the same place for TCP and UDP
+    size_t hlen = (protocol == IPPROTO_TCP ? sizeof(struct tcphdr) : sizeof(struct udphdr));
+    __be16 *ports = (__be16 *) (header->data + header->iplen);
+    ports[0] = source;
+    ports[1] = dest;
+    header->len = (uint8_t) (header->iplen + hlen);
+    header->sum = calc_checksum(csum, header->data + header->iplen, hlen);
+}
+
 // https://en.wikipedia.org/wiki/IPv6_packet#Extension_headers
 // http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml
 int is_lower_layer(int protocol) {
@@ -269,14 +356,18 @@ void handle_ip(const struct arguments *args,
 
     flags[flen] = 0;
 
+    // Search UDP session once
+    int has_udp = (protocol == IPPROTO_UDP && has_udp_session(args, pkt, payload));
+
     // Limit number of sessions
-    if (sessions >= maxsessions) {
+    int active = get_session_count(args->ctx);
+    if (active >= maxsessions) {
         if ((protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6) ||
-            (protocol == IPPROTO_UDP && !has_udp_session(args, pkt, payload)) ||
+            (protocol == IPPROTO_UDP && !has_udp) ||
             (protocol == IPPROTO_TCP && syn)) {
             log_android(ANDROID_LOG_ERROR,
                         "%d of max %d sessions, dropping version %d protocol %d",
-                        sessions, maxsessions, protocol, version);
+                        active, maxsessions, protocol, version);
             return;
         }
     }
@@ -304,7 +395,7 @@ void handle_ip(const struct arguments *args,
 
     // Get uid
     if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6 ||
-        (protocol == IPPROTO_UDP && !has_udp_session(args, pkt, payload)) ||
+        (protocol == IPPROTO_UDP && !has_udp) ||
         (protocol == IPPROTO_TCP && syn)) {
         if (args->ctx->sdk <= 28) // Android 9 Pie
             uid = get_uid(version, protocol, saddr, sport, daddr, dport);
@@ -319,7 +410,7 @@ void handle_ip(const struct arguments *args,
     // Check if allowed
     int allowed = 0;
     struct allowed *redirect = NULL;
-    if (protocol == IPPROTO_UDP && has_udp_session(args, pkt, payload))
+    if (has_udp)
         allowed = 1; // could be a lingering/blocked session
     else if (protocol == IPPROTO_TCP && (!syn || (uid == 0 && dport == 53)) && *server_name == 0)
         allowed = 1; // assume existing session
@@ -334,23 +425,37 @@ void handle_ip(const struct arguments *args,
             allowed = 0;
     }
 
-    // Handle allowed traffic
+    // Handle allowed traffic, the handlers return the session of the packet
+    struct ng_session *s = NULL;
     if (allowed) {
         if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6)
-            handle_icmp(args, pkt, length, payload, uid, epoll_fd);
+            s = handle_icmp(args, pkt, length, payload, uid, epoll_fd);
         else if (protocol == IPPROTO_UDP)
-            handle_udp(args, pkt, length, payload, uid, redirect, epoll_fd);
+            s = handle_udp(args, pkt, length, payload, uid, redirect, epoll_fd);
         else if (protocol == IPPROTO_TCP)
-            handle_tcp(args, pkt, length, payload, uid, allowed, redirect, epoll_fd);
+            s = handle_tcp(args, pkt, length, payload, uid, allowed, redirect, epoll_fd);
     } else {
         if (protocol == IPPROTO_UDP)
-            block_udp(args, pkt, length, payload, uid);
+            s = block_udp(args, pkt, length, payload, uid);
         else if (protocol == IPPROTO_TCP && *server_name != 0 && !allowed)
-            handle_tcp(args, pkt, length, payload, uid, allowed, redirect, epoll_fd); // RST
+            s = handle_tcp(args, pkt, length, payload, uid, allowed, redirect, epoll_fd); // RST
 
         log_android(ANDROID_LOG_WARN, "Address v%d p%d %s/%u syn %d not allowed",
                     version, protocol, dest, dport, syn);
     }
+
+    // Update session counters, timer and socket events
+    if (s != NULL) {
+        account_session(args->ctx, s);
+        schedule_session(args->ctx, s, get_session_deadline(s, sessions, maxsessions));
+
+        // Window and queue changes can unblock pending socket events
+        if (protocol == IPPROTO_TCP && s->socket >= 0 &&
+            (s->ready_queued || (s->ready & (EPOLLIN | EPOLLOUT)))) {
+            s->ready_due = 0;
+            ready_session(args->ctx, s);
+        }
+    }
 }
 
 jint get_uid(const int version, const int protocol,
@@ -19,7 +19,8 @@
 
 #include "netguard.h"
 
-// It is assumed that no packets will get lost and that packets arrive in order
+// It is assumed that packets arrive in order,
+// TCP data written to the tun is kept until acknowledged and retransmitted when lost
 // https://android.googlesource.com/platform/frameworks/base.git/+/master/services/core/jni/com_android_server_connectivity_Vpn.cpp
 
 // Global variables
@@ -39,6 +40,9 @@ extern long pcap_file_size;
 extern int uid_cache_size;
 extern struct uid_cache_entry *uid_cache;
 
+extern atomic_llong pool_hits;
+extern atomic_llong pool_misses;
+
 // JNI
 
 jclass clsPacket;
@@ -158,10 +162,10 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1run(
 
     log_android(ANDROID_LOG_WARN, "Running tun %d fwd53 %d level %d", tun, fwd53, loglevel);
 
-    // Set blocking
+    // Set non blocking, the tun is read until EAGAIN
     int flags = fcntl(tun, F_GETFL, 0);
-    if (flags < 0 || fcntl(tun, F_SETFL, flags & ~O_NONBLOCK) < 0)
-        log_android(ANDROID_LOG_ERROR, "fcntl tun ~O_NONBLOCK error %d: %s",
+    if (flags < 0 || fcntl(tun, F_SETFL, flags | O_NONBLOCK) < 0)
+        log_android(ANDROID_LOG_ERROR, "fcntl tun O_NONBLOCK error %d: %s",
                     errno, strerror(errno));
 
     // Get arguments
@@ -172,6 +176,7 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1run(
     args->fwd53 = fwd53;
     args->rcode = rcode;
     args->ctx = ctx;
+    args->writer = NULL;
     handle_events(args);
 }
 
@@ -206,27 +211,21 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1get_1stats(
     if (pthread_mutex_lock(&ctx->lock))
         log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
 
-    jintArray jarray = (*env)->NewIntArray(env, 5);
+    jintArray jarray = (*env)->NewIntArray(env, 9);
     jint *jcount = (*env)->GetIntArrayElements(env, jarray, NULL);
 
-    struct ng_session *s = ctx->ng_session;
-    while (s != NULL) {
-        if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-            if (!s->icmp.stop)
-                jcount[0]++;
-        } else if (s->protocol == IPPROTO_UDP) {
-            if (s->udp.state == UDP_ACTIVE)
-                jcount[1]++;
-        } else if (s->protocol == IPPROTO_TCP) {
-            if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE)
-                jcount[2]++;
-        }
-        s = s->next;
-    }
+    jcount[0] = ctx->icmp_sessions;
+    jcount[1] = ctx->udp_sessions;
+    jcount[2] = ctx->tcp_sessions;
+    jcount[5] = (jint) ctx->packets;
+    jcount[6] = (jint) ctx->syscalls;
 
     if (pthread_mutex_unlock(&ctx->lock))
         log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
 
+    jcount[7] = (jint) atomic_load(&pool_hits);
+    jcount[8] = (jint) atomic_load(&pool_misses);
+
     jcount[3] = 0;
     DIR *d = opendir("/proc/self/fd");
     if (d) {
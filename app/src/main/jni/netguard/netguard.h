@@ -6,6 +6,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <setjmp.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -15,6 +16,8 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <dlfcn.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
@@ -37,12 +40,15 @@
 
 // #define PROFILE_JNI 5
 // #define PROFILE_MEMORY
+// #define CHECK_SESSIONS
+// #define CHECK_SEND_QUEUE
 
 #define EPOLL_TIMEOUT 3600 // seconds
 #define EPOLL_EVENTS 20
-#define EPOLL_MIN_CHECK 100 // milliseconds
 
 #define TUN_YIELD 10 // packets
+#define TUN_URING 16 // reads in flight, 0 = no io_uring
+#define TUN_WRITES 64 // writes per io_uring_enter, 0 = write directly
 
 #define ICMP4_MAXMSG (IP_MAXPACKET - 20 - 8) // bytes (socket)
 #define ICMP6_MAXMSG (IPV6_MAXPACKET - 40 - 8) // bytes (socket)
@@ -60,12 +66,41 @@
 #define TCP_IDLE_TIMEOUT 3600 // seconds ~net.inet.tcp.keepidle
 #define TCP_CLOSE_TIMEOUT 20 // seconds
 #define TCP_KEEP_TIMEOUT 300 // seconds
+#define TCP_PROBE_MIN 200 // milliseconds
+#define TCP_PROBE_MAX 60000 // milliseconds
+#define TCP_RECV_MAX 65536 // bytes, socket read per event
+#define TCP_SACK_BLOCKS 4 // per ACK, 36 bytes of options
+#define TCP_RTO_INIT 1000 // milliseconds
+#define TCP_RTO_MIN 50 // milliseconds, above delayed ACKs
+#define TCP_RTO_MAX 60000 // milliseconds
+#define TCP_DUPACKS 3 // duplicate ACKs before a fast retransmit
+#define TCP_RETRANSMIT_BURST 4 // segments per ACK
+#define TCP_SACK_RANGES 16 // acknowledged by SACK, kept per session
+#define TCP_ACK_SEGMENTS 2 // full segments per delayed ACK
+#define TCP_ACK_DELAY 10 // milliseconds
+#define TCP_SYN_DATA 1 // send SYN data upstream with TCP Fast Open, 0 = plain connect
+#define TCP_FASTOPEN_CACHE 64 // destinations
+#define TCP_FASTOPEN_BACKOFF 600 // seconds without SYN data after a failure
+#define TCP_FASTOPEN_COOKIE 8 // bytes
 // https://en.wikipedia.org/wiki/Maximum_segment_lifetime
 
 #define SESSION_LIMIT 40 // percent
 #define SESSION_MAX (1024 * SESSION_LIMIT / 100) // number
+#define SESSION_HASH_SIZE 1024 // buckets, power of two
+#define SESSION_LOAD_STEP 10 // percent
+
+#define POOL_CLASSES 6 // packet buffer sizes from 128 bytes to 1 MiB
+#define POOL_BUFFERS 128 // cached per size class and thread, fewer of the larger sizes
+
+#define RECV_WINDOW_INIT 65536 // bytes, autotuned up to RECV_WINDOW_MAX
+#define RECV_WINDOW_MAX 1048576 // bytes, like the maximum of net.ipv4.tcp_rmem
+
+#define FORWARD_MIN 2048 // bytes, reassembly buffer, power of two
+#define FORWARD_MAX RECV_WINDOW_MAX // bytes, reassembly buffer, holds the largest receive window
+#define FORWARD_RANGES 16 // received ranges per session
 
 #define SEND_BUF_DEFAULT 163840 // bytes
+#define SEND_LOWAT 16384 // bytes, unsent data before EPOLLOUT
 
 #define UID_MAX_AGE 30000 // milliseconds
 
@@ -74,6 +109,25 @@
 #define SOCKS5_AUTH 3
 #define SOCKS5_CONNECT 4
 #define SOCKS5_CONNECTED 5
+#define SOCKS5_PIPELINE 1 // send all requests at once, 0 = wait for every reply
+#define SOCKS5_POOL 4 // authenticated proxy connections kept per event loop, 0 = no pool
+#define SOCKS5_POOL_IDLE 30 // seconds, pooled connection age and refill after last use
+#define SOCKS5_POOL_RETRY 10 // seconds without refill after a failed connection
+
+struct socks5_conn {
+    jint socket; // -1 = free
+    uint8_t state; // SOCKS5_NONE = connecting, SOCKS5_CONNECT = ready
+    time_t time; // opened
+    struct epoll_event ev;
+};
+
+struct socks5_pool {
+    int epoll_fd;
+    int count;
+    time_t used; // last flow through the proxy
+    time_t failed;
+    struct socks5_conn conn[SOCKS5_POOL > 0 ? SOCKS5_POOL : 1];
+};
 
 struct context {
     pthread_mutex_t lock;
@@ -81,6 +135,59 @@ struct context {
     int stopping;
     int sdk;
     struct ng_session *ng_session;
+    struct ng_session *ng_hash[SESSION_HASH_SIZE];
+    struct ng_session **timers; // min-heap on deadline
+    int timer_count;
+    int timer_size;
+    int timer_load; // percent
+    int icmp_sessions; // active
+    int udp_sessions;
+    int tcp_sessions;
+    struct ng_session *ready_first; // sessions with pending socket events
+    struct ng_session *ready_last;
+    long long packets; // read from tun and UDP sockets
+    long long syscalls; // spent reading those packets
+    long long written; // packets written to tun
+    long long write_syscalls;
+    long long forwarded; // segments sent or queued to sockets
+    long long send_syscalls;
+    long long retransmitted; // segments written to tun again
+    long long fastopen; // connections sending data with the SYN
+    struct socks5_pool *socks5; // NULL until the proxy is used
+    long long socks5_hits; // flows using a pooled proxy connection
+    long long socks5_misses;
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct tun_ring {
+    int fd; // io_uring
+    int event; // eventfd, signalled on completions
+    unsigned int entries;
+    size_t mtu;
+    uint8_t *buffers; // registered, one read per entry, NULL for writes
+    int tun;
+    int tun_flags; // restored when destroyed, -1 = unchanged
+    void *sq_map;
+    size_t sq_size;
+    void *cq_map;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int queued; // not submitted yet
+    void **pending; // buffers being written, per write slot
+    struct iovec *iov;
+    unsigned int *free_slots;
+    unsigned int free_count;
 };
 
 struct arguments {
@@ -90,6 +197,7 @@ struct arguments {
     jboolean fwd53;
     jint rcode;
     struct context *ctx;
+    struct tun_ring *writer; // batched tun writes, NULL to write directly
 };
 
 struct allowed {
@@ -97,13 +205,24 @@ struct allowed {
     uint16_t rport; // host notation
 };
 
-struct segment {
-    uint32_t seq;
-    uint16_t len;
-    uint16_t sent;
-    int psh;
-    uint8_t *data;
-    struct segment *next;
+struct forward_range {
+    uint32_t start; // host notation
+    uint32_t end; // host notation, exclusive
+};
+
+// Data received from the tun, not forwarded to the socket yet,
+// stored in a ring buffer at the offset of its sequence number
+struct forward_queue {
+    uint8_t *data; // NULL when empty
+    uint32_t size; // bytes, power of two
+    uint32_t head; // ring offset of seq
+    uint32_t seq; // host notation, next byte to forward
+    uint32_t buffered; // bytes
+    uint32_t psh; // host notation, end of the last pushed data
+    uint32_t last; // host notation, end of the data queued last
+    int pushed;
+    int count;
+    struct forward_range range[FORWARD_RANGES]; // sorted, not adjacent
 };
 
 struct icmp_session {
@@ -131,6 +250,16 @@ struct icmp_session {
 #define UDP_CLOSED 2
 #define UDP_BLOCKED 3
 
+// Prebuilt IP and transport header of the packets written to the tun,
+// the variable fields are zero and excluded from the partial checksums
+struct header_template {
+    uint8_t data[sizeof(struct ip6_hdr) + sizeof(struct tcphdr)];
+    uint8_t iplen; // bytes
+    uint8_t len; // bytes, IP and transport header
+    uint16_t ip_sum; // IP4 header
+    uint16_t sum; // pseudo header and transport header
+};
+
 struct udp_session {
     time_t time;
     jint uid;
@@ -153,6 +282,7 @@ struct udp_session {
     __be16 dest; // network notation
 
     uint8_t state;
+    struct header_template header;
 };
 
 struct tcp_session {
@@ -162,7 +292,13 @@ struct tcp_session {
     uint16_t mss;
     uint8_t recv_scale;
     uint8_t send_scale;
+    int sack; // SACK permitted
+    int fastopen; // cookie requested
+    uint32_t syn_data; // bytes sent upstream with the SYN
     uint32_t recv_window; // host notation, scaled
+    uint32_t recv_budget; // bytes, autotuned receive window
+    uint32_t recv_period; // host notation, end of the window measured
+    int recv_limited; // data reached the window edge in the period
     uint32_t send_window; // host notation, scaled
     uint16_t unconfirmed; // packets
 
@@ -173,10 +309,32 @@ struct tcp_session {
 
     uint32_t acked; // host notation
     long long last_keep_alive;
+    uint32_t probe_backoff; // milliseconds, 0 = not probing
+    long long probe_due; // milliseconds, parked on the deadline heap until then, 0 = not parked
+
+    uint32_t srtt; // milliseconds
+    uint32_t rttvar; // milliseconds
+    uint32_t rto; // milliseconds
+    long long rto_due; // milliseconds, 0 = nothing to retransmit
+    long long rtt_time; // milliseconds, 0 = not timing
+    uint32_t rtt_seq; // host notation, end of the segment timed
+    uint32_t recover; // host notation, end of the data sent at loss
+    uint32_t rexmit; // host notation, next byte to retransmit
+    struct forward_range sacked[TCP_SACK_RANGES]; // sorted, above acked
+    int sacked_count;
+
+    uint32_t ack_bytes; // received in order since the last ACK
+    long long ack_due; // milliseconds, 0 = no ACK delayed
+    int recovering;
+    uint16_t dupacks;
 
     uint64_t sent;
     uint64_t received;
 
+    uint32_t sndbuf; // bytes, SO_SNDBUF, 0 = not read yet
+    uint32_t unsent; // bytes, estimate of the socket send queue
+    int unsent_stale; // read the queue from the kernel
+
     union {
         __be32 ip4; // network notation
         struct in6_addr ip6;
@@ -191,7 +349,9 @@ struct tcp_session {
 
     uint8_t state;
     uint8_t socks5;
-    struct segment *forward;
+    struct forward_queue forward;
+    struct forward_queue unacked; // written to the tun, not acknowledged yet
+    struct header_template header;
 };
 
 struct ng_session {
@@ -203,7 +363,17 @@ struct ng_session {
     };
     jint socket;
     struct epoll_event ev;
+    time_t deadline;
+    int timer; // heap index, -1 if not scheduled
+    int active; // counted in context
+    uint32_t ready; // epoll events not consumed yet, edge triggered
+    int ready_queued;
+    long long ready_due; // milliseconds, recheck of a stalled session
+    struct ng_session *ready_next;
+    uint32_t hash;
     struct ng_session *next;
+    struct ng_session *prev;
+    struct ng_session *hash_next;
 };
 
 struct uid_cache_entry {
@@ -359,6 +529,37 @@ void check_allowed(const struct arguments *args);
 
 void clear(struct context *ctx);
 
+uint32_t hash_session(uint8_t protocol, int version,
+                      const void *saddr, __be16 source,
+                      const void *daddr, __be16 dest);
+
+struct ng_session *find_session(const struct context *ctx,
+                                uint8_t protocol, int version,
+                                const void *saddr, __be16 source,
+                                const void *daddr, __be16 dest);
+
+void add_session(struct context *ctx, struct ng_session *s);
+
+void remove_session(struct context *ctx, struct ng_session *s);
+
+void ready_session(struct context *ctx, struct ng_session *s);
+
+int is_active_session(const struct ng_session *s);
+
+void account_session(struct context *ctx, struct ng_session *s);
+
+int get_session_count(const struct context *ctx);
+
+void check_session_count(const struct context *ctx);
+
+time_t get_session_deadline(const struct ng_session *s, int sessions, int maxsessions);
+
+void schedule_session(struct context *ctx, struct ng_session *s, time_t deadline);
+
+void unschedule_session(struct context *ctx, struct ng_session *s);
+
+struct ng_session *get_expired_session(struct context *ctx, time_t now);
+
 int check_icmp_session(const struct arguments *args,
                        struct ng_session *s,
                        int sessions, int maxsessions);
@@ -371,7 +572,10 @@ int check_tcp_session(const struct arguments *args,
                       struct ng_session *s,
                       int sessions, int maxsessions);
 
-int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int epoll_fd);
+unsigned int get_tcp_interest(const struct ng_session *s, int *blocked);
+
+int check_tcp_ready(const struct arguments *args, struct ng_session *s,
+                    const int epoll_fd, long long *due);
 
 int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions);
 
@@ -388,9 +592,35 @@ int check_tun(const struct arguments *args,
               const int epoll_fd,
               int sessions, int maxsessions);
 
+int check_tun_packet(const struct arguments *args,
+                     const uint8_t *buffer, size_t length,
+                     const int epoll_fd,
+                     int sessions, int maxsessions);
+
+struct tun_ring *init_tun_ring(const struct arguments *args);
+
+void destroy_tun_ring(struct tun_ring *ring);
+
+int check_tun_ring(const struct arguments *args, struct tun_ring *ring,
+                   const int epoll_fd,
+                   int sessions, int maxsessions);
+
+struct tun_ring *init_tun_writer(const struct arguments *args);
+
+int queue_tun_write(const struct arguments *args, struct tun_ring *ring,
+                    uint8_t *buffer, size_t len);
+
+int flush_tun_writes(const struct arguments *args, struct tun_ring *ring);
+
+ssize_t write_tun(const struct arguments *args, uint8_t *buffer, size_t len);
+
+void init_header_template(struct header_template *header, int version, uint8_t protocol,
+                          const void *saddr, __be16 source,
+                          const void *daddr, __be16 dest);
+
 void check_icmp_socket(const struct arguments *args, const struct epoll_event *ev);
 
-void check_udp_socket(const struct arguments *args, const struct epoll_event *ev);
+int check_udp_socket(const struct arguments *args, const struct epoll_event *ev);
 
 int32_t get_qname(const uint8_t *data, const size_t datalen, uint16_t off, char *qname);
 
@@ -399,9 +629,9 @@ void parse_dns_response(const struct arguments *args, const struct ng_session *s
 
 uint32_t get_send_window(const struct tcp_session *cur);
 
-uint32_t get_receive_buffer(const struct ng_session *cur);
+uint32_t get_receive_buffer(struct ng_session *cur);
 
-uint32_t get_receive_window(const struct ng_session *cur);
+uint32_t get_receive_window(struct ng_session *cur);
 
 void check_tcp_socket(const struct arguments *args,
                       const struct epoll_event *ev,
@@ -416,35 +646,59 @@ void handle_ip(const struct arguments *args,
                const int epoll_fd,
                int sessions, int maxsessions);
 
-jboolean handle_icmp(const struct arguments *args,
-                     const uint8_t *pkt, size_t length,
-                     const uint8_t *payload,
-                     int uid,
-                     const int epoll_fd);
+struct ng_session *handle_icmp(const struct arguments *args,
+                               const uint8_t *pkt, size_t length,
+                               const uint8_t *payload,
+                               int uid,
+                               const int epoll_fd);
 
 int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload);
 
-void block_udp(const struct arguments *args,
-               const uint8_t *pkt, size_t length,
-               const uint8_t *payload,
-               int uid);
+struct ng_session *block_udp(const struct arguments *args,
+                             const uint8_t *pkt, size_t length,
+                             const uint8_t *payload,
+                             int uid);
 
-jboolean handle_udp(const struct arguments *args,
-                    const uint8_t *pkt, size_t length,
-                    const uint8_t *payload,
-                    int uid, struct allowed *redirect,
-                    const int epoll_fd);
+struct ng_session *handle_udp(const struct arguments *args,
+                              const uint8_t *pkt, size_t length,
+                              const uint8_t *payload,
+                              int uid, struct allowed *redirect,
+                              const int epoll_fd);
 
 int check_dhcp(const struct arguments *args, const struct udp_session *u,
                const uint8_t *data, const size_t datalen);
 
 void clear_tcp_data(struct tcp_session *cur);
 
-jboolean handle_tcp(const struct arguments *args,
-                    const uint8_t *pkt, size_t length,
-                    const uint8_t *payload,
-                    int uid, int allowed, struct allowed *redirect,
-                    const int epoll_fd);
+int insert_forward(struct forward_queue *q, uint32_t next, uint32_t seq,
+                   const uint8_t *data, size_t len, int psh, uint16_t csum);
+
+int queue_forward(struct forward_queue *q, uint32_t next, uint32_t seq,
+                  const uint8_t *data, size_t len, int psh);
+
+int extend_forward(struct forward_queue *q, uint32_t next, uint32_t len, struct iovec *iov);
+
+void append_forward(struct forward_queue *q, uint32_t len);
+
+uint32_t get_forward_ready(const struct forward_queue *q, uint32_t seq);
+
+int peek_forward(const struct forward_queue *q, struct iovec *iov);
+
+int read_forward(const struct forward_queue *q, uint32_t seq, struct iovec *iov);
+
+int get_forward_sack(const struct forward_queue *q, struct forward_range *block, int max);
+
+void release_forward(struct forward_queue *q, uint32_t len);
+
+void consume_forward(struct forward_queue *q, uint32_t len);
+
+void clear_forward(struct forward_queue *q);
+
+struct ng_session *handle_tcp(const struct arguments *args,
+                              const uint8_t *pkt, size_t length,
+                              const uint8_t *payload,
+                              int uid, int allowed, struct allowed *redirect,
+                              const int epoll_fd);
 
 void queue_tcp(const struct arguments *args,
                const struct tcphdr *tcphdr,
@@ -456,8 +710,30 @@ int open_icmp_socket(const struct arguments *args, const struct icmp_session *cu
 int open_udp_socket(const struct arguments *args,
                     const struct udp_session *cur, const struct allowed *redirect);
 
+int create_tcp_socket(const struct arguments *args, int version);
+
 int open_tcp_socket(const struct arguments *args,
-                    const struct tcp_session *cur, const struct allowed *redirect);
+                    struct tcp_session *cur, const struct allowed *redirect, int fastopen);
+
+size_t get_socks5_request(uint8_t state, const struct tcp_session *cur, uint8_t *buffer);
+
+int parse_socks5(const char *session, uint8_t *state, const uint8_t *buffer, size_t len);
+
+int fill_socks5_pool(const struct arguments *args, int epoll_fd);
+
+int is_socks5_pool(const struct context *ctx, const void *ptr);
+
+void check_socks5_pool(const struct arguments *args, const struct epoll_event *ev);
+
+int take_socks5_pool(const struct arguments *args);
+
+void clear_socks5_pool(const struct arguments *args);
+
+const uint8_t *get_fastopen_cookie();
+
+int check_fastopen(const struct tcp_session *cur);
+
+void update_fastopen(const struct tcp_session *cur, int accepted);
 
 int32_t get_local_port(const int sock);
 
@@ -502,6 +778,8 @@ int protect_socket(const struct arguments *args, int socket);
 
 uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length);
 
+uint16_t copy_checksum(uint16_t start, uint8_t *dest, const uint8_t *src, size_t length);
+
 jobject jniGlobalRef(JNIEnv *env, jobject cls);
 
 jclass jniFindClass(JNIEnv *env, const char *name);
@@ -576,6 +854,10 @@ void ng_add_alloc(const void *ptr, const char *tag);
 void ng_delete_alloc(const void *ptr, const char *file, int line);
 //Daven-
 
+void *get_packet_buffer(size_t size, const char *tag);
+
+void put_packet_buffer(void *buffer);
+
 void *ng_malloc(size_t __byte_count, const char *tag);
 
 void *ng_calloc(size_t __item_count, size_t __item_size, const char *tag);
@@ -0,0 +1,108 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+// Packet buffers are recycled through a cache per thread and size class,
+// so no locking is needed.
+// A small header in front of each buffer remembers its size class.
+
+#define POOL_HEADER 16 // bytes, keeps buffers aligned
+
+static const size_t pool_class_size[POOL_CLASSES] = {128, 2048, 16384, 65536, 262144, 1048576};
+
+// About 2.5 MiB per thread at most, larger buffers are freed when the cache is full
+static const int pool_class_max[POOL_CLASSES] = {POOL_BUFFERS, POOL_BUFFERS, 16, 8, 2, 1};
+
+struct pool_cache {
+    void *free[POOL_CLASSES][POOL_BUFFERS];
+    int count[POOL_CLASSES];
+};
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+atomic_llong pool_hits;
+atomic_llong pool_misses;
+
+static void free_pool_cache(void *data) {
+    struct pool_cache *cache = (struct pool_cache *) data;
+    for (int c = 0; c < POOL_CLASSES; c++)
+        for (int i = 0; i < cache->count[c]; i++)
+            ng_free(cache->free[c][i], __FILE__, __LINE__);
+    ng_free(cache, __FILE__, __LINE__);
+}
+
+static void init_pool_key() {
+    int err = pthread_key_create(&pool_key, free_pool_cache);
+    if (err)
+        log_android(ANDROID_LOG_ERROR, "pthread_key_create error %d: %s", err, strerror(err));
+}
+
+static struct pool_cache *get_pool_cache() {
+    pthread_once(&pool_once, init_pool_key);
+    struct pool_cache *cache = pthread_getspecific(pool_key);
+    if (cache == NULL) {
+        cache = ng_calloc(1, sizeof(struct pool_cache), "pool cache");
+        pthread_setspecific(pool_key, cache);
+    }
+    return cache;
+}
+
+void *get_packet_buffer(size_t size, const char *tag) {
+    int c = 0;
+    while (c < POOL_CLASSES && pool_class_size[c] < size)
+        c++;
+
+    uint8_t *block = NULL;
+    if (c < POOL_CLASSES) {
+        struct pool_cache *cache = get_pool_cache();
+        if (cache->count[c] > 0) {
+            block = cache->free[c][--cache->count[c]];
+            atomic_fetch_add_explicit(&pool_hits, 1, memory_order_relaxed);
+        } else {
+            block = ng_malloc(POOL_HEADER + pool_class_size[c], tag);
+            atomic_fetch_add_explicit(&pool_misses, 1, memory_order_relaxed);
+        }
+    } else {
+        // Oversized, not recycled
+        block = ng_malloc(POOL_HEADER + size, tag);
+        atomic_fetch_add_explicit(&pool_misses, 1, memory_order_relaxed);
+    }
+
+    *(int *) block = c;
+    return block + POOL_HEADER;
+}
+
+void put_packet_buffer(void *buffer) {
+    if (buffer == NULL)
+        return;
+
+    uint8_t *block = ((uint8_t *) buffer) - POOL_HEADER;
+    int c = *(int *) block;
+    if (c < POOL_CLASSES) {
+        struct pool_cache *cache = get_pool_cache();
+        if (cache->count[c] < pool_class_max[c]) {
+            cache->free[c][cache->count[c]++] = block;
+            return;
+        }
+    }
+
+    ng_free(block, __FILE__, __LINE__);
+}
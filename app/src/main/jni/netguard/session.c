@@ -19,6 +19,9 @@
 
 #include "netguard.h"
 
+extern atomic_llong pool_hits;
+extern atomic_llong pool_misses;
+
 void clear(struct context *ctx) {
     struct ng_session *s = ctx->ng_session;
     while (s != NULL) {
@@ -32,6 +35,345 @@ void clear(struct context *ctx) {
         ng_free(p, __FILE__, __LINE__);
     }
     ctx->ng_session = NULL;
+    memset(ctx->ng_hash, 0, sizeof(ctx->ng_hash));
+    ctx->ready_first = NULL;
+    ctx->ready_last = NULL;
+
+    if (ctx->timers != NULL)
+        ng_free(ctx->timers, __FILE__, __LINE__);
+    ctx->timers = NULL;
+    ctx->timer_count = 0;
+    ctx->timer_size = 0;
+
+    ctx->icmp_sessions = 0;
+    ctx->udp_sessions = 0;
+    ctx->tcp_sessions = 0;
+}
+
+uint32_t hash_session(uint8_t protocol, int version,
+                      const void *saddr, __be16 source,
+                      const void *daddr, __be16 dest) {
+    uint32_t h = ((uint32_t) protocol << 8) | (uint32_t) version;
+
+    // Mix addresses one word at a time
+    uint32_t w;
+    int words = (version == 4 ? 1 : 4);
+    for (int i = 0; i < words; i++) {
+        memcpy(&w, (const uint8_t *) saddr + i * 4, 4);
+        h = (h ^ w) * 0x01000193;
+        memcpy(&w, (const uint8_t *) daddr + i * 4, 4);
+        h = (h ^ w) * 0x01000193;
+    }
+    h ^= ((uint32_t) source << 16) | (uint32_t) dest;
+
+    // Finalize (murmur3)
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static void get_session_key(const struct ng_session *s, int *version,
+                            const void **saddr, __be16 *source,
+                            const void **daddr, __be16 *dest) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
+        *version = s->icmp.version;
+        *saddr = &s->icmp.saddr;
+        *daddr = &s->icmp.daddr;
+        *source = 0;
+        *dest = 0;
+    } else if (s->protocol == IPPROTO_UDP) {
+        *version = s->udp.version;
+        *saddr = &s->udp.saddr;
+        *daddr = &s->udp.daddr;
+        *source = s->udp.source;
+        *dest = s->udp.dest;
+    } else {
+        *version = s->tcp.version;
+        *saddr = &s->tcp.saddr;
+        *daddr = &s->tcp.daddr;
+        *source = s->tcp.source;
+        *dest = s->tcp.dest;
+    }
+}
+
+struct ng_session *find_session(const struct context *ctx,
+                                uint8_t protocol, int version,
+                                const void *saddr, __be16 source,
+                                const void *daddr, __be16 dest) {
+    uint32_t hash = hash_session(protocol, version, saddr, source, daddr, dest);
+    size_t alen = (version == 4 ? 4 : 16);
+
+    struct ng_session *s = ctx->ng_hash[hash & (SESSION_HASH_SIZE - 1)];
+    while (s != NULL) {
+        if (s->hash == hash && s->protocol == protocol) {
+            int sversion;
+            const void *ssaddr;
+            const void *sdaddr;
+            __be16 ssource;
+            __be16 sdest;
+            get_session_key(s, &sversion, &ssaddr, &ssource, &sdaddr, &sdest);
+            if (sversion == version && ssource == source && sdest == dest &&
+                memcmp(ssaddr, saddr, alen) == 0 && memcmp(sdaddr, daddr, alen) == 0)
+                return s;
+        }
+        s = s->hash_next;
+    }
+
+    return NULL;
+}
+
+static void count_session(struct context *ctx, const struct ng_session *s, int delta) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        ctx->icmp_sessions += delta;
+    else if (s->protocol == IPPROTO_UDP)
+        ctx->udp_sessions += delta;
+    else
+        ctx->tcp_sessions += delta;
+}
+
+void add_session(struct context *ctx, struct ng_session *s) {
+    int version;
+    const void *saddr;
+    const void *daddr;
+    __be16 source;
+    __be16 dest;
+    get_session_key(s, &version, &saddr, &source, &daddr, &dest);
+    s->hash = hash_session(s->protocol, version, saddr, source, daddr, dest);
+
+    s->timer = -1;
+    s->active = 0;
+    s->ready = 0;
+    s->ready_queued = 0;
+    s->ready_due = 0;
+    account_session(ctx, s);
+
+    struct ng_session **bucket = &ctx->ng_hash[s->hash & (SESSION_HASH_SIZE - 1)];
+    s->hash_next = *bucket;
+    *bucket = s;
+
+    s->prev = NULL;
+    s->next = ctx->ng_session;
+    if (ctx->ng_session != NULL)
+        ctx->ng_session->prev = s;
+    ctx->ng_session = s;
+}
+
+void remove_session(struct context *ctx, struct ng_session *s) {
+    struct ng_session **h = &ctx->ng_hash[s->hash & (SESSION_HASH_SIZE - 1)];
+    while (*h != NULL && *h != s)
+        h = &(*h)->hash_next;
+    if (*h == s)
+        *h = s->hash_next;
+    else
+        log_android(ANDROID_LOG_ERROR, "Session %p not in hash table", s);
+
+    if (s->prev == NULL)
+        ctx->ng_session = s->next;
+    else
+        s->prev->next = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+
+    unschedule_session(ctx, s);
+
+    if (s->active)
+        count_session(ctx, s, -1);
+    s->active = 0;
+
+    if (s->ready_queued) {
+        struct ng_session **r = &ctx->ready_first;
+        struct ng_session *prev = NULL;
+        while (*r != NULL && *r != s) {
+            prev = *r;
+            r = &(*r)->ready_next;
+        }
+        if (*r == s) {
+            *r = s->ready_next;
+            if (ctx->ready_last == s)
+                ctx->ready_last = prev;
+        }
+        s->ready_queued = 0;
+    }
+}
+
+void ready_session(struct context *ctx, struct ng_session *s) {
+    if (s->ready_queued)
+        return;
+
+    s->ready_queued = 1;
+    s->ready_next = NULL;
+    if (ctx->ready_last == NULL)
+        ctx->ready_first = s;
+    else
+        ctx->ready_last->ready_next = s;
+    ctx->ready_last = s;
+}
+
+int is_active_session(const struct ng_session *s) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        return !s->icmp.stop;
+    else if (s->protocol == IPPROTO_UDP)
+        return (s->udp.state == UDP_ACTIVE);
+    else
+        return (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE);
+}
+
+void account_session(struct context *ctx, struct ng_session *s) {
+    int active = is_active_session(s);
+    if (active != s->active) {
+        count_session(ctx, s, active ? 1 : -1);
+        s->active = active;
+    }
+}
+
+int get_session_count(const struct context *ctx) {
+    return ctx->icmp_sessions + ctx->udp_sessions + ctx->tcp_sessions;
+}
+
+void check_session_count(const struct context *ctx) {
+    int isessions = 0;
+    int usessions = 0;
+    int tsessions = 0;
+    struct ng_session *s = ctx->ng_session;
+    while (s != NULL) {
+        if (is_active_session(s)) {
+            if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+                isessions++;
+            else if (s->protocol == IPPROTO_UDP)
+                usessions++;
+            else
+                tsessions++;
+        }
+        s = s->next;
+    }
+
+    if (isessions != ctx->icmp_sessions ||
+        usessions != ctx->udp_sessions ||
+        tsessions != ctx->tcp_sessions)
+        log_android(ANDROID_LOG_ERROR,
+                    "Session count ICMP %d/%d UDP %d/%d TCP %d/%d",
+                    ctx->icmp_sessions, isessions,
+                    ctx->udp_sessions, usessions,
+                    ctx->tcp_sessions, tsessions);
+}
+
+time_t get_session_deadline(const struct ng_session *s, int sessions, int maxsessions) {
+    // Mirrors the checks in check_icmp_session, check_udp_session and check_tcp_session
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
+        if (s->icmp.stop)
+            return 0;
+        return s->icmp.time + get_icmp_timeout(&s->icmp, sessions, maxsessions) + 1;
+
+    } else if (s->protocol == IPPROTO_UDP) {
+        if (s->udp.state == UDP_ACTIVE)
+            return s->udp.time + get_udp_timeout(&s->udp, sessions, maxsessions) + 1;
+        else if (s->udp.state == UDP_FINISHING)
+            return 0;
+        else
+            return s->udp.time + UDP_KEEP_TIMEOUT + 1;
+
+    } else {
+        if (s->tcp.state == TCP_CLOSING)
+            return 0;
+        else if (s->tcp.state == TCP_CLOSE) {
+            if (s->tcp.sent || s->tcp.received)
+                return 0; // account usage
+            return s->tcp.time + TCP_KEEP_TIMEOUT + 1;
+        }
+
+        time_t deadline = s->tcp.time + get_tcp_timeout(&s->tcp, sessions, maxsessions) + 1;
+        if (s->tcp.probe_due) {
+            time_t probe = time(NULL) + (time_t) ((s->tcp.probe_due - get_ms() + 999) / 1000);
+            if (probe < deadline)
+                deadline = probe;
+        }
+        return deadline;
+    }
+}
+
+static void swap_timers(struct context *ctx, int a, int b) {
+    struct ng_session *t = ctx->timers[a];
+    ctx->timers[a] = ctx->timers[b];
+    ctx->timers[b] = t;
+    ctx->timers[a]->timer = a;
+    ctx->timers[b]->timer = b;
+}
+
+static void sift_up_timer(struct context *ctx, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (ctx->timers[parent]->deadline <= ctx->timers[i]->deadline)
+            break;
+        swap_timers(ctx, i, parent);
+        i = parent;
+    }
+}
+
+static void sift_down_timer(struct context *ctx, int i) {
+    while (1) {
+        int min = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < ctx->timer_count &&
+            ctx->timers[left]->deadline < ctx->timers[min]->deadline)
+            min = left;
+        if (right < ctx->timer_count &&
+            ctx->timers[right]->deadline < ctx->timers[min]->deadline)
+            min = right;
+        if (min == i)
+            break;
+        swap_timers(ctx, i, min);
+        i = min;
+    }
+}
+
+void schedule_session(struct context *ctx, struct ng_session *s, time_t deadline) {
+    if (s->timer >= 0) {
+        // Postponing is done lazily when the timer fires
+        if (deadline < s->deadline) {
+            s->deadline = deadline;
+            sift_up_timer(ctx, s->timer);
+        }
+        return;
+    }
+
+    if (ctx->timer_count >= ctx->timer_size) {
+        int size = (ctx->timer_size == 0 ? 64 : ctx->timer_size * 2);
+        ctx->timers = ng_realloc(ctx->timers, sizeof(struct ng_session *) * size, "timers");
+        ctx->timer_size = size;
+    }
+
+    s->deadline = deadline;
+    s->timer = ctx->timer_count++;
+    ctx->timers[s->timer] = s;
+    sift_up_timer(ctx, s->timer);
+}
+
+void unschedule_session(struct context *ctx, struct ng_session *s) {
+    int i = s->timer;
+    if (i < 0)
+        return;
+
+    int last = --ctx->timer_count;
+    if (i != last) {
+        swap_timers(ctx, i, last);
+        sift_down_timer(ctx, i);
+        sift_up_timer(ctx, i);
+    }
+    s->timer = -1;
+}
+
+struct ng_session *get_expired_session(struct context *ctx, time_t now) {
+    if (ctx->timer_count == 0 || ctx->timers[0]->deadline > now)
+        return NULL;
+
+    struct ng_session *s = ctx->timers[0];
+    unschedule_session(ctx, s);
+    return s;
 }
 
 void *handle_events(void *a) {
@@ -74,111 +416,146 @@ void *handle_events(void *a) {
     }
 
     // Monitor tun events
+    struct tun_ring *ring = init_tun_ring(args);
+    args->writer = init_tun_writer(args);
     struct epoll_event ev_tun;
     memset(&ev_tun, 0, sizeof(struct epoll_event));
     ev_tun.events = EPOLLIN | EPOLLERR;
     ev_tun.data.ptr = NULL;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->tun, &ev_tun)) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ring != NULL ? ring->event : args->tun, &ev_tun)) {
         log_android(ANDROID_LOG_ERROR, "epoll add tun error %d: %s", errno, strerror(errno));
         report_exit(args, "epoll add tun error %d: %s", errno, strerror(errno));
         args->ctx->stopping = 1;
     }
 
     // Loop
-    long long last_check = 0;
     while (!args->ctx->stopping) {
         log_android(ANDROID_LOG_DEBUG, "Loop");
 
-        int recheck = 0;
         int timeout = EPOLL_TIMEOUT;
 
-        // Count sessions
-        int isessions = 0;
-        int usessions = 0;
-        int tsessions = 0;
-        struct ng_session *s = args->ctx->ng_session;
-        while (s != NULL) {
-            if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-                if (!s->icmp.stop)
-                    isessions++;
-            } else if (s->protocol == IPPROTO_UDP) {
-                if (s->udp.state == UDP_ACTIVE)
-                    usessions++;
-            } else if (s->protocol == IPPROTO_TCP) {
-                if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE)
-                    tsessions++;
-                if (s->socket >= 0)
-                    recheck = recheck | monitor_tcp_session(args, s, epoll_fd);
+#ifdef CHECK_SESSIONS
+        check_session_count(args->ctx);
+#endif
+
+        struct ng_session *s;
+        int sessions = get_session_count(args->ctx);
+
+        // Timeouts shrink with the number of sessions
+        int load = sessions * 100 / maxsessions;
+        if (load < args->ctx->timer_load)
+            args->ctx->timer_load = load;
+        else if (load >= args->ctx->timer_load + SESSION_LOAD_STEP) {
+            log_android(ANDROID_LOG_WARN, "Reschedule sessions load %d%%", load);
+            args->ctx->timer_load = load;
+            s = args->ctx->ng_session;
+            while (s != NULL) {
+                schedule_session(args->ctx, s, get_session_deadline(s, sessions, maxsessions));
+                s = s->next;
             }
-            s = s->next;
         }
-        int sessions = isessions + usessions + tsessions;
 
-        // Check sessions
-        long long ms = get_ms();
-        if (ms - last_check > EPOLL_MIN_CHECK) {
-            last_check = ms;
+        // Check expired sessions
+        time_t now = time(NULL);
+        while ((s = get_expired_session(args->ctx, now)) != NULL) {
+            int del = 0;
+            if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+                del = check_icmp_session(args, s, sessions, maxsessions);
+            else if (s->protocol == IPPROTO_UDP)
+                del = check_udp_session(args, s, sessions, maxsessions);
+            else if (s->protocol == IPPROTO_TCP)
+                del = check_tcp_session(args, s, sessions, maxsessions);
+
+            if (del) {
+                remove_session(args->ctx, s);
+                if (s->protocol == IPPROTO_TCP)
+                    clear_tcp_data(&s->tcp);
+                ng_free(s, __FILE__, __LINE__);
+            } else {
+                account_session(args->ctx, s);
+                schedule_session(args->ctx, s, get_session_deadline(s, sessions, maxsessions));
+            }
+        }
 
-            time_t now = time(NULL);
-            struct ng_session *sl = NULL;
-            s = args->ctx->ng_session;
+        // Check ready sessions
+        int busy = 0;
+        long long due = 0;
+        if (args->ctx->ready_first != NULL) {
+            if (pthread_mutex_lock(&args->ctx->lock))
+                log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
+            // Sessions with more work are added again
+            long long ms = get_ms();
+            s = args->ctx->ready_first;
+            args->ctx->ready_first = NULL;
+            args->ctx->ready_last = NULL;
             while (s != NULL) {
-                int del = 0;
-                if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-                    del = check_icmp_session(args, s, sessions, maxsessions);
-                    if (!s->icmp.stop && !del) {
-                        int stimeout = s->icmp.time +
-                                       get_icmp_timeout(&s->icmp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_UDP) {
-                    del = check_udp_session(args, s, sessions, maxsessions);
-                    if (s->udp.state == UDP_ACTIVE && !del) {
-                        int stimeout = s->udp.time +
-                                       get_udp_timeout(&s->udp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_TCP) {
-                    del = check_tcp_session(args, s, sessions, maxsessions);
-                    if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE && !del) {
-                        int stimeout = s->tcp.time +
-                                       get_tcp_timeout(&s->tcp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
+                struct ng_session *next = s->ready_next;
+                s->ready_queued = 0;
+
+                // Sessions wait for a new event or their timer
+                if (s->ready_due > ms) {
+                    ready_session(args->ctx, s);
+                    if (due == 0 || s->ready_due < due)
+                        due = s->ready_due;
+                    s = next;
+                    continue;
                 }
 
-                if (del) {
-                    if (sl == NULL)
-                        args->ctx->ng_session = s->next;
-                    else
-                        sl->next = s->next;
-
-                    struct ng_session *c = s;
-                    s = s->next;
-                    if (c->protocol == IPPROTO_TCP)
-                        clear_tcp_data(&c->tcp);
-                    ng_free(c, __FILE__, __LINE__);
-                } else {
-                    sl = s;
-                    s = s->next;
+                if (check_tcp_ready(args, s, epoll_fd, &s->ready_due)) {
+                    ready_session(args->ctx, s);
+                    if (s->ready_due == 0)
+                        busy = 1;
+                    else if (due == 0 || s->ready_due < due)
+                        due = s->ready_due;
                 }
+
+                account_session(args->ctx, s);
+                schedule_session(args->ctx, s, get_session_deadline(s, sessions, maxsessions));
+
+                s = next;
             }
-        } else {
-            recheck = 1;
-            log_android(ANDROID_LOG_DEBUG, "Skipped session checks");
+
+            if (pthread_mutex_unlock(&args->ctx->lock))
+                log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+        }
+
+        // Keep authenticated proxy connections ready
+        int expiry = fill_socks5_pool(args, epoll_fd);
+        if (expiry > 0 && expiry < timeout)
+            timeout = expiry;
+
+        if (args->ctx->timer_count > 0) {
+            time_t deadline = args->ctx->timers[0]->deadline;
+            if (deadline <= now)
+                timeout = 0;
+            else if (deadline - now < timeout)
+                timeout = (int) (deadline - now);
+        }
+
+        int wait = timeout * 1000;
+        if (busy)
+            wait = 0;
+        else if (due) {
+            long long probe = due - get_ms();
+            if (probe < wait)
+                wait = (probe > 0 ? (int) probe : 0);
         }
 
         log_android(ANDROID_LOG_DEBUG,
-                    "sessions ICMP %d UDP %d TCP %d max %d/%d timeout %d recheck %d",
-                    isessions, usessions, tsessions, sessions, maxsessions, timeout, recheck);
+                    "sessions ICMP %d UDP %d TCP %d max %d/%d timeout %d wait %d busy %d",
+                    args->ctx->icmp_sessions, args->ctx->udp_sessions, args->ctx->tcp_sessions,
+                    sessions, maxsessions, timeout, wait, busy);
+
+        // Write packets to the tun before waiting, a busy loop fills the batch first
+        if (args->writer != NULL && !busy && flush_tun_writes(args, args->writer) < 0) {
+            destroy_tun_ring(args->writer);
+            args->writer = NULL;
+        }
 
         // Poll
         struct epoll_event ev[EPOLL_EVENTS];
-        int ready = epoll_wait(epoll_fd, ev, EPOLL_EVENTS,
-                               recheck ? EPOLL_MIN_CHECK : timeout * 1000);
+        int ready = epoll_wait(epoll_fd, ev, EPOLL_EVENTS, wait);
 
         if (ready < 0) {
             if (errno == EINTR) {
@@ -222,14 +599,26 @@ void *handle_events(void *a) {
                                 (ev[i].events & EPOLLERR) != 0,
                                 (ev[i].events & EPOLLHUP) != 0);
 
-                    int count = 0;
-                    while (count < TUN_YIELD && !error && !args->ctx->stopping &&
-                           is_readable(args->tun)) {
-                        count++;
-                        if (check_tun(args, &ev[i], epoll_fd, sessions, maxsessions) < 0)
+                    if (ring != NULL) {
+                        if (check_tun_ring(args, ring, epoll_fd, sessions, maxsessions) < 0)
                             error = 1;
+                    } else {
+                        // Drain until EAGAIN, level triggered for the rest
+                        int count = 0;
+                        while (count < TUN_YIELD && !error && !args->ctx->stopping) {
+                            int read = check_tun(args, &ev[i], epoll_fd, sessions, maxsessions);
+                            if (read < 0)
+                                error = 1;
+                            else if (read == 0)
+                                break;
+                            count++;
+                        }
                     }
 
+                } else if (is_socks5_pool(args->ctx, ev[i].data.ptr)) {
+                    // Check proxy connection
+                    check_socks5_pool(args, &ev[i]);
+
                 } else {
                     // Check downstream
                     log_android(ANDROID_LOG_DEBUG,
@@ -249,13 +638,23 @@ void *handle_events(void *a) {
                     else if (session->protocol == IPPROTO_UDP) {
                         int count = 0;
                         while (count < UDP_YIELD && !args->ctx->stopping &&
-                               !(ev[i].events & EPOLLERR) && (ev[i].events & EPOLLIN) &&
-                               is_readable(session->socket)) {
+                               !(ev[i].events & EPOLLERR) && (ev[i].events & EPOLLIN)) {
                             count++;
-                            check_udp_socket(args, &ev[i]);
+                            if (check_udp_socket(args, &ev[i]) <= 0)
+                                break;
                         }
-                    } else if (session->protocol == IPPROTO_TCP)
-                        check_tcp_socket(args, &ev[i], epoll_fd);
+                    } else if (session->protocol == IPPROTO_TCP) {
+                        // Edge triggered, handled from the ready list
+                        session->ready |= ev[i].events;
+                        session->ready_due = 0;
+                        if (ev[i].events & EPOLLOUT)
+                            session->tcp.unsent_stale = 1; // send queue below SEND_LOWAT
+                        ready_session(args->ctx, session);
+                    }
+
+                    account_session(args->ctx, session);
+                    schedule_session(args->ctx, session,
+                                     get_session_deadline(session, sessions, maxsessions));
                 }
 
                 if (error)
@@ -270,12 +669,26 @@ void *handle_events(void *a) {
         }
     }
 
+    clear_socks5_pool(args);
+
     // Close epoll file
     if (epoll_fd >= 0 && close(epoll_fd))
         log_android(ANDROID_LOG_ERROR,
                     "epoll close error %d: %s", errno, strerror(errno));
 
-    log_android(ANDROID_LOG_WARN, "Stopped events tun=%d", args->tun);
+    destroy_tun_ring(ring);
+    destroy_tun_ring(args->writer);
+    args->writer = NULL;
+
+    log_android(ANDROID_LOG_WARN,
+                "Stopped events tun=%d packets %lld syscalls %lld written %lld syscalls %lld"
+                " forwarded %lld syscalls %lld retransmitted %lld fastopen %lld"
+                " socks5 hits %lld misses %lld pool hits %lld misses %lld",
+                args->tun, args->ctx->packets, args->ctx->syscalls,
+                args->ctx->written, args->ctx->write_syscalls,
+                args->ctx->forwarded, args->ctx->send_syscalls, args->ctx->retransmitted,
+                args->ctx->fastopen, args->ctx->socks5_hits, args->ctx->socks5_misses,
+                atomic_load(&pool_hits), atomic_load(&pool_misses));
 
     // Cleanup
     ng_free(args, __FILE__, __LINE__);
@@ -287,7 +700,6 @@ void check_allowed(const struct arguments *args) {
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
 
-    struct ng_session *l = NULL;
     struct ng_session *s = args->ctx->ng_session;
     while (s != NULL) {
         if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
@@ -305,6 +717,8 @@ void check_allowed(const struct arguments *args) {
                         source, 0, dest, 0, "", s->icmp.uid, 0);
                 if (is_address_allowed(args, objPacket) == NULL) {
                     s->icmp.stop = 1;
+                    account_session(args->ctx, s);
+                    schedule_session(args->ctx, s, 0);
                     log_android(ANDROID_LOG_WARN, "ICMP terminate %d uid %d",
                                 s->socket, s->icmp.uid);
                 }
@@ -325,19 +739,17 @@ void check_allowed(const struct arguments *args) {
                         source, ntohs(s->udp.source), dest, ntohs(s->udp.dest), "", s->udp.uid, 0);
                 if (is_address_allowed(args, objPacket) == NULL) {
                     s->udp.state = UDP_FINISHING;
+                    account_session(args->ctx, s);
+                    schedule_session(args->ctx, s, 0);
                     log_android(ANDROID_LOG_WARN, "UDP terminate session socket %d uid %d",
                                 s->socket, s->udp.uid);
                 }
             } else if (s->udp.state == UDP_BLOCKED) {
                 log_android(ANDROID_LOG_WARN, "UDP remove blocked session uid %d", s->udp.uid);
 
-                if (l == NULL)
-                    args->ctx->ng_session = s->next;
-                else
-                    l->next = s->next;
-
                 struct ng_session *c = s;
                 s = s->next;
+                remove_session(args->ctx, c);
                 ng_free(c, __FILE__, __LINE__);
                 continue;
             }
@@ -357,6 +769,8 @@ void check_allowed(const struct arguments *args) {
                         source, ntohs(s->tcp.source), dest, ntohs(s->tcp.dest), "", s->tcp.uid, 0);
                 if (is_address_allowed(args, objPacket) == NULL) {
                     write_rst(args, &s->tcp);
+                    account_session(args->ctx, s);
+                    schedule_session(args->ctx, s, 0);
                     log_android(ANDROID_LOG_WARN, "TCP terminate socket %d uid %d",
                                 s->socket, s->tcp.uid);
                 }
@@ -364,7 +778,6 @@ void check_allowed(const struct arguments *args) {
 
         }
 
-        l = s;
         s = s->next;
     }
 }
@@ -0,0 +1,386 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+// https://tools.ietf.org/html/rfc1928
+// https://tools.ietf.org/html/rfc1929
+// Every event loop keeps up to SOCKS5_POOL connections to the proxy
+// which completed the greeting and the authentication,
+// so a new flow only needs the CONNECT request and its reply.
+// The pool is refilled while flows use the proxy and is left to expire when idle.
+
+extern char socks5_addr[INET6_ADDRSTRLEN + 1];
+extern int socks5_port;
+extern char socks5_username[127 + 1];
+extern char socks5_password[127 + 1];
+
+// The request for a SOCKS5 state, without a session the requests stop before CONNECT,
+// when pipelined the greeting offers one method only and is followed by all other requests
+size_t get_socks5_request(uint8_t state, const struct tcp_session *cur, uint8_t *buffer) {
+    size_t len = 0;
+    if (state == SOCKS5_HELLO) {
+        *(buffer + len++) = 5; // version
+        if (SOCKS5_PIPELINE) {
+            *(buffer + len++) = 1; // methods
+            *(buffer + len++) = (uint8_t) (*socks5_username ? 2 : 0);
+        } else {
+            *(buffer + len++) = 2; // methods
+            *(buffer + len++) = 0; // no authentication
+            *(buffer + len++) = 2; // username/password
+        }
+        if (!SOCKS5_PIPELINE)
+            return len;
+    }
+
+    if (state == SOCKS5_AUTH || (state == SOCKS5_HELLO && *socks5_username)) {
+        uint8_t ulen = strlen(socks5_username);
+        uint8_t plen = strlen(socks5_password);
+        *(buffer + len++) = 1; // version
+        *(buffer + len++) = ulen;
+        memcpy(buffer + len, socks5_username, ulen);
+        len += ulen;
+        *(buffer + len++) = plen;
+        memcpy(buffer + len, socks5_password, plen);
+        len += plen;
+        if (!SOCKS5_PIPELINE)
+            return len;
+    }
+
+    if (cur == NULL)
+        return len;
+
+    *(buffer + len++) = 5; // version
+    *(buffer + len++) = 1; // TCP/IP stream connection
+    *(buffer + len++) = 0; // reserved
+    *(buffer + len++) = (uint8_t) (cur->version == 4 ? 1 : 4);
+    if (cur->version == 4) {
+        memcpy(buffer + len, &cur->daddr.ip4, 4);
+        len += 4;
+    } else {
+        memcpy(buffer + len, &cur->daddr.ip6, 16);
+        len += 16;
+    }
+    memcpy(buffer + len, &cur->dest, 2);
+    len += 2;
+
+    return len;
+}
+
+// Advances the SOCKS5 state over the complete replies,
+// returns the number of bytes used or -1 on error
+int parse_socks5(const char *session, uint8_t *state, const uint8_t *buffer, size_t len) {
+    size_t used = 0;
+    while (*state != SOCKS5_CONNECTED) {
+        const uint8_t *reply = buffer + used;
+        size_t avail = len - used;
+
+        if (*state == SOCKS5_HELLO) {
+            if (avail < 2)
+                break;
+            int method = reply[1];
+            if (reply[0] != 5 ||
+                (SOCKS5_PIPELINE && method != (*socks5_username ? 2 : 0)) ||
+                (method != 0 && method != 2)) {
+                log_android(ANDROID_LOG_ERROR, "%s SOCKS5 auth %d not supported",
+                            session, method);
+                return -1;
+            }
+            *state = (uint8_t) (method == 2 ? SOCKS5_AUTH : SOCKS5_CONNECT);
+            used += 2;
+
+        } else if (*state == SOCKS5_AUTH) {
+            if (avail < 2)
+                break;
+            if ((reply[0] != 1 && reply[0] != 5) || reply[1] != 0) {
+                log_android(ANDROID_LOG_ERROR, "%s SOCKS5 auth error %d",
+                            session, reply[1]);
+                return -1;
+            }
+            log_android(ANDROID_LOG_WARN, "%s SOCKS5 auth OK", session);
+            *state = SOCKS5_CONNECT;
+            used += 2;
+
+        } else if (*state == SOCKS5_CONNECT) {
+            // Version, reply, reserved, bound address type, address and port
+            if (avail < 5)
+                break;
+            size_t alen;
+            if (reply[3] == 1)
+                alen = 4;
+            else if (reply[3] == 4)
+                alen = 16;
+            else if (reply[3] == 3)
+                alen = 1 + reply[4];
+            else
+                alen = 0;
+            if (reply[0] != 5 || alen == 0) {
+                log_android(ANDROID_LOG_ERROR, "%s SOCKS5 connect reply invalid", session);
+                return -1;
+            }
+            if (avail < 4 + alen + 2)
+                break;
+            if (reply[1] != 0) {
+                log_android(ANDROID_LOG_ERROR, "%s SOCKS5 connect error %d",
+                            session, reply[1]);
+                /*
+                    0x00 = request granted
+                    0x01 = general failure
+                    0x02 = connection not allowed by ruleset
+                    0x03 = network unreachable
+                    0x04 = host unreachable
+                    0x05 = connection refused by destination host
+                    0x06 = TTL expired
+                    0x07 = command not supported / protocol error
+                    0x08 = address type not supported
+                 */
+                return -1;
+            }
+            log_android(ANDROID_LOG_WARN, "%s SOCKS5 connected", session);
+            *state = SOCKS5_CONNECTED;
+            used += 4 + alen + 2;
+
+        } else
+            return -1;
+    }
+
+    return (int) used;
+}
+
+static void close_socks5(const struct arguments *args, struct socks5_conn *c) {
+    struct socks5_pool *pool = args->ctx->socks5;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, c->socket, &c->ev))
+        log_android(ANDROID_LOG_ERROR, "epoll del SOCKS5 pool error %d: %s",
+                    errno, strerror(errno));
+    if (close(c->socket))
+        log_android(ANDROID_LOG_ERROR, "SOCKS5 pool close error %d: %s",
+                    errno, strerror(errno));
+    c->socket = -1;
+    pool->count--;
+}
+
+static void fail_socks5(const struct arguments *args, struct socks5_conn *c) {
+    args->ctx->socks5->failed = time(NULL);
+    close_socks5(args, c);
+}
+
+static int open_socks5(const struct arguments *args, struct socks5_conn *c) {
+    int version = (strstr(socks5_addr, ":") == NULL ? 4 : 6);
+    int sock = create_tcp_socket(args, version);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_in addr4;
+    struct sockaddr_in6 addr6;
+    memset(&addr4, 0, sizeof(struct sockaddr_in));
+    memset(&addr6, 0, sizeof(struct sockaddr_in6));
+    if (version == 4) {
+        addr4.sin_family = AF_INET;
+        inet_pton(AF_INET, socks5_addr, &addr4.sin_addr);
+        addr4.sin_port = htons(socks5_port);
+    } else {
+        addr6.sin6_family = AF_INET6;
+        inet_pton(AF_INET6, socks5_addr, &addr6.sin6_addr);
+        addr6.sin6_port = htons(socks5_port);
+    }
+
+    int err = connect(sock,
+                      (version == 4 ? (const struct sockaddr *) &addr4
+                                    : (const struct sockaddr *) &addr6),
+                      (socklen_t) (version == 4
+                                   ? sizeof(struct sockaddr_in)
+                                   : sizeof(struct sockaddr_in6)));
+    if (err < 0 && errno != EINPROGRESS) {
+        log_android(ANDROID_LOG_ERROR, "SOCKS5 pool connect error %d: %s",
+                    errno, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    c->socket = sock;
+    c->state = SOCKS5_NONE;
+    c->time = time(NULL);
+    memset(&c->ev, 0, sizeof(struct epoll_event));
+    c->ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLET;
+    c->ev.data.ptr = c;
+    if (epoll_ctl(args->ctx->socks5->epoll_fd, EPOLL_CTL_ADD, sock, &c->ev)) {
+        log_android(ANDROID_LOG_ERROR, "epoll add SOCKS5 pool error %d: %s",
+                    errno, strerror(errno));
+        close(sock);
+        c->socket = -1;
+        return -1;
+    }
+
+    args->ctx->socks5->count++;
+    return 0;
+}
+
+// Closes expired connections and opens new ones while the proxy is in use,
+// returns the seconds until the next expiry, 0 if none
+int fill_socks5_pool(const struct arguments *args, int epoll_fd) {
+    struct socks5_pool *pool = args->ctx->socks5;
+    if (pool == NULL)
+        return 0;
+    pool->epoll_fd = epoll_fd;
+
+    time_t now = time(NULL);
+    int wanted = (*socks5_addr && socks5_port &&
+                  now - pool->used < SOCKS5_POOL_IDLE &&
+                  now - pool->failed >= SOCKS5_POOL_RETRY);
+
+    int next = 0;
+    for (int i = 0; i < SOCKS5_POOL; i++) {
+        struct socks5_conn *c = &pool->conn[i];
+        if (c->socket >= 0 && now - c->time >= SOCKS5_POOL_IDLE) {
+            log_android(ANDROID_LOG_INFO, "Pool socket %d expired", c->socket);
+            close_socks5(args, c);
+        }
+
+        if (c->socket < 0 && wanted && open_socks5(args, c) < 0) {
+            pool->failed = now;
+            wanted = 0;
+        }
+
+        if (c->socket >= 0) {
+            int left = (int) (c->time + SOCKS5_POOL_IDLE - now);
+            if (next == 0 || left < next)
+                next = (left > 0 ? left : 1);
+        }
+    }
+
+    return next;
+}
+
+int is_socks5_pool(const struct context *ctx, const void *ptr) {
+    return (ctx->socks5 != NULL &&
+            ptr >= (const void *) ctx->socks5->conn &&
+            ptr < (const void *) (ctx->socks5->conn + SOCKS5_POOL));
+}
+
+void check_socks5_pool(const struct arguments *args, const struct epoll_event *ev) {
+    struct socks5_conn *c = (struct socks5_conn *) ev->data.ptr;
+    if (c->socket < 0)
+        return;
+
+    char session[40];
+    sprintf(session, "Pool socket %d", c->socket);
+
+    // A connection which is ready has nothing to receive
+    if ((ev->events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ||
+        (c->state == SOCKS5_CONNECT && (ev->events & EPOLLIN))) {
+        log_android(ANDROID_LOG_WARN, "%s closed state %d", session, c->state);
+        if (c->state == SOCKS5_CONNECT)
+            close_socks5(args, c);
+        else
+            fail_socks5(args, c);
+        return;
+    }
+
+    uint8_t oldstate = c->state;
+    if (c->state == SOCKS5_NONE) {
+        if (ev->events & EPOLLOUT)
+            c->state = SOCKS5_HELLO;
+    } else if (ev->events & EPOLLIN) {
+        // Replies are taken only when complete
+        uint8_t buffer[512];
+        ssize_t bytes = recv(c->socket, buffer, sizeof(buffer), MSG_PEEK);
+        if (bytes < 0 && errno == EAGAIN)
+            return;
+
+        int used = (bytes > 0 ? parse_socks5(session, &c->state, buffer, (size_t) bytes) : -1);
+        if (used < 0 || c->state == SOCKS5_CONNECTED ||
+            (c->state == SOCKS5_CONNECT && used != bytes) ||
+            (used > 0 && recv(c->socket, buffer, (size_t) used, 0) != used)) {
+            log_android(ANDROID_LOG_ERROR, "%s recv %d state %d", session, bytes, c->state);
+            fail_socks5(args, c);
+            return;
+        }
+        if (c->state == SOCKS5_CONNECT)
+            log_android(ANDROID_LOG_INFO, "%s ready", session);
+    }
+
+    if (c->state != oldstate &&
+        (c->state == SOCKS5_HELLO || (!SOCKS5_PIPELINE && c->state == SOCKS5_AUTH))) {
+        uint8_t buffer[512];
+        size_t len = get_socks5_request(c->state, NULL, buffer);
+        if (send(c->socket, buffer, len, MSG_NOSIGNAL) != (ssize_t) len) {
+            log_android(ANDROID_LOG_ERROR, "%s send state %d error %d: %s",
+                        session, c->state, errno, strerror(errno));
+            fail_socks5(args, c);
+        }
+    }
+}
+
+// Returns a connection which is ready for the CONNECT request, or -1
+int take_socks5_pool(const struct arguments *args) {
+    if (SOCKS5_POOL <= 0)
+        return -1;
+
+    struct socks5_pool *pool = args->ctx->socks5;
+    if (pool == NULL) {
+        pool = ng_malloc(sizeof(struct socks5_pool), "socks5 pool");
+        pool->epoll_fd = -1;
+        pool->count = 0;
+        pool->failed = 0;
+        for (int i = 0; i < SOCKS5_POOL; i++)
+            pool->conn[i].socket = -1;
+        args->ctx->socks5 = pool;
+    }
+    pool->used = time(NULL);
+
+    for (int i = 0; i < SOCKS5_POOL; i++) {
+        struct socks5_conn *c = &pool->conn[i];
+        if (c->socket < 0 || c->state != SOCKS5_CONNECT)
+            continue;
+
+        // The proxy might have closed the connection without an event yet
+        uint8_t b;
+        ssize_t bytes = recv(c->socket, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (bytes >= 0 || errno != EAGAIN) {
+            close_socks5(args, c);
+            continue;
+        }
+
+        int sock = c->socket;
+        if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, sock, &c->ev))
+            log_android(ANDROID_LOG_ERROR, "epoll del SOCKS5 pool error %d: %s",
+                        errno, strerror(errno));
+        c->socket = -1;
+        pool->count--;
+
+        args->ctx->socks5_hits++;
+        return sock;
+    }
+
+    args->ctx->socks5_misses++;
+    return -1;
+}
+
+void clear_socks5_pool(const struct arguments *args) {
+    struct socks5_pool *pool = args->ctx->socks5;
+    if (pool == NULL)
+        return;
+
+    for (int i = 0; i < SOCKS5_POOL; i++)
+        if (pool->conn[i].socket >= 0)
+            close_socks5(args, &pool->conn[i]);
+
+    ng_free(pool, __FILE__, __LINE__);
+    args->ctx->socks5 = NULL;
+}
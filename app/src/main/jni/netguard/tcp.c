@@ -23,17 +23,366 @@ extern char socks5_addr[INET6_ADDRSTRLEN + 1];
 extern int socks5_port;
 extern char socks5_username[127 + 1];
 extern char socks5_password[127 + 1];
-
-extern FILE *pcap_file;
+extern int loglevel;
 
 void clear_tcp_data(struct tcp_session *cur) {
-    struct segment *s = cur->forward;
-    while (s != NULL) {
-        struct segment *p = s;
-        s = s->next;
-        ng_free(p->data, __FILE__, __LINE__);
-        ng_free(p, __FILE__, __LINE__);
+    clear_forward(&cur->forward);
+    clear_forward(&cur->unacked);
+}
+
+// The header sum of the session also covers the pseudo header and the ports
+// of the packets received from the tun, because the addition is commutative
+static uint16_t get_segment_checksum(const struct tcp_session *cur,
+                                     const struct tcphdr *tcphdr, uint16_t datalen) {
+    __be16 tcplen = htons((uint16_t) (tcphdr->doff * 4 + datalen));
+    uint16_t csum = calc_checksum(cur->header.sum, (uint8_t *) &tcplen, 2);
+    return calc_checksum(csum, ((uint8_t *) tcphdr) + 4, (size_t) (tcphdr->doff * 4 - 4));
+}
+
+// Smallest scale which can advertise the largest autotuned window
+static uint8_t get_receive_scale() {
+    uint8_t scale = 0;
+    while ((((uint32_t) 0xFFFF) << scale) < RECV_WINDOW_MAX && scale < 14)
+        scale++;
+    return scale;
+}
+
+// The receive window starts small and doubles for every window of data
+// in which the sender reached the edge of the window, like receive buffer autotuning
+static void tune_receive_window(struct tcp_session *cur, uint32_t seq, uint16_t datalen) {
+    if (compare_u32(seq + datalen + cur->mss, cur->remote_seq + cur->recv_window) >= 0)
+        cur->recv_limited = 1;
+
+    if (compare_u32(cur->remote_seq, cur->recv_period) < 0)
+        return;
+
+    if (cur->recv_limited && cur->recv_budget < RECV_WINDOW_MAX) {
+        cur->recv_budget <<= 1;
+        cur->sndbuf = 0; // the kernel grows the socket buffer too
+        log_android(ANDROID_LOG_DEBUG, "Receive budget %u", cur->recv_budget);
     }
+    cur->recv_period = cur->remote_seq + cur->recv_budget;
+    cur->recv_limited = 0;
+}
+
+// https://tools.ietf.org/html/rfc2018#section-3
+static int get_sack_blocks(const uint8_t *options, int optlen, struct forward_range *block) {
+    while (optlen > 0) {
+        uint8_t kind = *options;
+        if (kind == 0) // End of options list
+            break;
+        if (kind == 1) {
+            optlen--;
+            options++;
+            continue;
+        }
+
+        uint8_t len = (optlen > 1 ? *(options + 1) : 0);
+        if (len < 2 || len > optlen)
+            break;
+
+        if (kind == 5 && len >= 10 && (len - 2) % 8 == 0) {
+            int blocks = (len - 2) / 8;
+            if (blocks > TCP_SACK_BLOCKS)
+                blocks = TCP_SACK_BLOCKS;
+            for (int i = 0; i < blocks; i++) {
+                __be32 edge[2];
+                memcpy(edge, options + 2 + i * 8, 8);
+                block[i].start = ntohl(edge[0]);
+                block[i].end = ntohl(edge[1]);
+            }
+            return blocks;
+        }
+
+        optlen -= len;
+        options += len;
+    }
+    return 0;
+}
+
+// The data acknowledged by SACK is kept as sorted ranges above the cumulative ACK,
+// so holes reported by earlier ACKs are not retransmitted again
+static void update_sacked(struct tcp_session *cur, const struct forward_range *block, int blocks) {
+    int keep = 0;
+    for (int i = 0; i < cur->sacked_count; i++)
+        if (compare_u32(cur->sacked[i].end, cur->acked) > 0) {
+            cur->sacked[keep] = cur->sacked[i];
+            if (compare_u32(cur->sacked[keep].start, cur->acked) < 0)
+                cur->sacked[keep].start = cur->acked;
+            keep++;
+        }
+    cur->sacked_count = keep;
+
+    for (int b = 0; b < blocks; b++) {
+        struct forward_range r = block[b];
+        if (compare_u32(r.start, r.end) >= 0 ||
+            compare_u32(r.end, cur->acked) <= 0 || compare_u32(r.end, cur->local_seq) > 0)
+            continue;
+        if (compare_u32(r.start, cur->acked) < 0)
+            r.start = cur->acked;
+
+        // Merge
+        struct forward_range merged[TCP_SACK_RANGES + 1];
+        int n = 0;
+        int placed = 0;
+        for (int i = 0; i < cur->sacked_count; i++) {
+            struct forward_range e = cur->sacked[i];
+            if (compare_u32(e.end, r.start) < 0)
+                merged[n++] = e;
+            else if (compare_u32(r.end, e.start) < 0) {
+                if (!placed) {
+                    merged[n++] = r;
+                    placed = 1;
+                }
+                merged[n++] = e;
+            } else {
+                if (compare_u32(e.start, r.start) < 0)
+                    r.start = e.start;
+                if (compare_u32(e.end, r.end) > 0)
+                    r.end = e.end;
+            }
+        }
+        if (!placed)
+            merged[n++] = r;
+
+        cur->sacked_count = (n > TCP_SACK_RANGES ? TCP_SACK_RANGES : n);
+        memcpy(cur->sacked, merged, cur->sacked_count * sizeof(struct forward_range));
+    }
+}
+
+// https://tools.ietf.org/html/rfc6298
+static void update_rto(struct tcp_session *cur, uint32_t rtt) {
+    if (cur->srtt == 0 && cur->rttvar == 0) {
+        cur->srtt = rtt;
+        cur->rttvar = rtt / 2;
+    } else {
+        uint32_t delta = (cur->srtt > rtt ? cur->srtt - rtt : rtt - cur->srtt);
+        cur->rttvar = (3 * cur->rttvar + delta) / 4;
+        cur->srtt = (7 * cur->srtt + rtt) / 8;
+    }
+
+    cur->rto = cur->srtt + 4 * cur->rttvar;
+    if (cur->rto < TCP_RTO_MIN)
+        cur->rto = TCP_RTO_MIN;
+    if (cur->rto > TCP_RTO_MAX)
+        cur->rto = TCP_RTO_MAX;
+}
+
+// Write the data at seq again, one segment up to end
+// Returns the number of bytes written, 0 if the data is not queued
+static uint32_t retransmit_data(const struct arguments *args, struct tcp_session *cur,
+                                uint32_t seq, uint32_t end) {
+    struct iovec iov[2];
+    if (read_forward(&cur->unacked, seq, iov) == 0)
+        return 0;
+
+    uint32_t len = (uint32_t) iov[0].iov_len;
+    if (len > cur->mss)
+        len = cur->mss;
+    if (len > end - seq)
+        len = end - seq;
+
+    uint32_t next = cur->local_seq;
+    cur->local_seq = seq;
+    write_data(args, cur, iov[0].iov_base, len);
+    cur->local_seq = next;
+
+    cur->rtt_time = 0; // https://tools.ietf.org/html/rfc6298#section-3 Karn
+    args->ctx->retransmitted++;
+    return len;
+}
+
+// Write the first unacknowledged segment again, or the FIN if all data was acknowledged
+// Returns 0 if there was nothing to retransmit
+static int retransmit_first(const struct arguments *args, struct tcp_session *cur) {
+    if (cur->state == TCP_CLOSING || cur->state == TCP_CLOSE)
+        return 0; // reset
+
+    uint32_t len = retransmit_data(args, cur, cur->unacked.seq, cur->local_seq);
+    if (len > 0) {
+        cur->rexmit = cur->unacked.seq + len;
+        return 1;
+    }
+
+    if (cur->state != TCP_FIN_WAIT1 && cur->state != TCP_LAST_ACK)
+        return 0;
+
+    uint32_t next = cur->local_seq;
+    cur->local_seq--;
+    write_fin_ack(args, cur);
+    cur->local_seq = next;
+    cur->rtt_time = 0;
+    args->ctx->retransmitted++;
+    return 1;
+}
+
+// Write the holes between the data acknowledged by SACK again,
+// without SACK only the first unacknowledged segment, once per ACK
+// https://tools.ietf.org/html/rfc6675
+static void retransmit_holes(const struct arguments *args, struct tcp_session *cur) {
+    const struct forward_range *sacked = cur->sacked;
+    int count = cur->sacked_count;
+    uint32_t high = (count > 0 ? sacked[count - 1].end : cur->acked + 1);
+
+    if (compare_u32(cur->rexmit, cur->acked) < 0)
+        cur->rexmit = cur->acked;
+
+    int i = 0;
+    int burst = 0;
+    while (burst < TCP_RETRANSMIT_BURST && compare_u32(cur->rexmit, high) < 0) {
+        // Skip acknowledged data and stop at the next acknowledged data
+        while (i < count && compare_u32(sacked[i].end, cur->rexmit) <= 0)
+            i++;
+        if (i < count && compare_u32(sacked[i].start, cur->rexmit) <= 0) {
+            cur->rexmit = sacked[i].end;
+            continue;
+        }
+        uint32_t end = (i < count ? sacked[i].start : cur->local_seq);
+
+        uint32_t len = retransmit_data(args, cur, cur->rexmit, end);
+        if (len == 0)
+            break;
+        cur->rexmit += len;
+        burst++;
+    }
+}
+
+// Acknowledged data is released, duplicate ACKs start a fast retransmit
+// and further ACKs until all data sent at the loss is acknowledged retransmit the holes
+// https://tools.ietf.org/html/rfc5681#section-3.2
+// https://tools.ietf.org/html/rfc6582
+static void check_tcp_ack(const struct arguments *args, struct tcp_session *cur,
+                          uint32_t ack, int dup,
+                          const struct forward_range *block, int blocks) {
+    if (compare_u32(ack, cur->local_seq) > 0)
+        return; // future ACK
+
+    long long ms = get_ms();
+    struct forward_queue *q = &cur->unacked;
+    if (compare_u32(ack, cur->acked) > 0) {
+        if (q->count > 0 && compare_u32(ack, q->seq) > 0) {
+            uint32_t len = ack - q->seq;
+            uint32_t queued = q->range[0].end - q->seq;
+            release_forward(q, len < queued ? len : queued); // the FIN is not queued
+        }
+        if (cur->rtt_time && compare_u32(ack, cur->rtt_seq) >= 0) {
+            update_rto(cur, (uint32_t) (ms - cur->rtt_time));
+            cur->rtt_time = 0;
+        }
+
+        cur->acked = ack;
+        cur->dupacks = 0;
+        update_sacked(cur, block, blocks);
+        if (cur->recovering && compare_u32(ack, cur->recover) < 0)
+            retransmit_holes(args, cur);
+        else
+            cur->recovering = 0;
+        cur->rto_due = (ack == cur->local_seq ? 0 : ms + cur->rto);
+
+    } else if (dup && ack == cur->acked && ack != cur->local_seq) {
+        update_sacked(cur, block, blocks);
+        if (cur->recovering)
+            retransmit_holes(args, cur);
+        else if (++cur->dupacks == TCP_DUPACKS) {
+            log_android(ANDROID_LOG_WARN, "TCP fast retransmit %u",
+                        ack - cur->local_start);
+            cur->recovering = 1;
+            cur->recover = cur->local_seq;
+            cur->rexmit = ack;
+            retransmit_holes(args, cur);
+            cur->rto_due = ms + cur->rto;
+        }
+    }
+}
+
+// https://tools.ietf.org/html/rfc1122#page-96
+// In-order data is acknowledged every second full segment or when pushed,
+// else after TCP_ACK_DELAY, any segment written in the mean time carries the ACK
+static void delay_ack(struct tcp_session *cur, uint32_t bytes, int push) {
+    long long ms = get_ms();
+    cur->ack_bytes += bytes;
+    if (push || cur->ack_bytes >= TCP_ACK_SEGMENTS * get_default_mss(cur->version))
+        cur->ack_due = ms;
+    else if (cur->ack_due == 0)
+        cur->ack_due = ms + TCP_ACK_DELAY;
+}
+
+// Returns 1 if a delayed ACK was written
+static int flush_ack(const struct arguments *args, struct tcp_session *cur) {
+    if (cur->ack_due == 0 || get_ms() < cur->ack_due ||
+        cur->state == TCP_CLOSING || cur->state == TCP_CLOSE)
+        return 0;
+    return (write_ack(args, cur) >= 0);
+}
+
+// Earliest timer of the session, 0 if none
+static long long get_tcp_due(const struct tcp_session *cur) {
+    if (cur->ack_due && (cur->rto_due == 0 || cur->ack_due < cur->rto_due))
+        return cur->ack_due;
+    return cur->rto_due;
+}
+
+// Data was written, start the retransmission timer and time a segment
+static void sent_tcp(struct tcp_session *cur) {
+    long long ms = get_ms();
+    if (cur->rto_due == 0)
+        cur->rto_due = ms + cur->rto;
+    if (cur->rtt_time == 0) {
+        cur->rtt_time = ms;
+        cur->rtt_seq = cur->local_seq;
+    }
+}
+
+// Sent data is added to the estimate of the socket send queue,
+// which only errs on the high side and is read back after an EPOLLOUT edge
+static void account_send(struct ng_session *s, ssize_t sent) {
+    s->tcp.unsent += sent;
+}
+
+// In-order data is sent straight from the tun buffer when nothing is queued
+// and the socket was writable, only the unsent remainder is queued
+// Returns 1 if handled, 0 if the data should be queued and -1 if the checksum is invalid
+static int send_tcp(const struct arguments *args,
+                    const struct tcphdr *tcphdr,
+                    const char *session, struct ng_session *s,
+                    const uint8_t *data, uint16_t datalen) {
+    uint32_t seq = ntohl(tcphdr->seq) + tcphdr->syn; // Data follows a retransmitted SYN
+    if (!(s->ready & EPOLLOUT) || s->tcp.forward.count > 0 || seq != s->tcp.remote_seq ||
+        (s->tcp.state != TCP_SYN_RECV && s->tcp.state != TCP_ESTABLISHED) ||
+        (s->tcp.socks5 != SOCKS5_NONE && s->tcp.socks5 != SOCKS5_CONNECTED))
+        return 0;
+
+    uint16_t csum = get_segment_checksum(&s->tcp, tcphdr, datalen);
+    if (calc_checksum(csum, data, datalen) != 0xFFFF) {
+        log_android(ANDROID_LOG_WARN, "%s invalid checksum", session);
+        return -1;
+    }
+
+    ssize_t sent = send(s->socket, data, datalen,
+                        (unsigned int) (MSG_NOSIGNAL | (tcphdr->psh ? 0 : MSG_MORE)));
+    args->ctx->send_syscalls++;
+    if (sent < 0) {
+        if (errno == EAGAIN)
+            s->ready &= ~EPOLLOUT;
+        return 0;
+    }
+    account_send(s, sent);
+
+    log_android(ANDROID_LOG_DEBUG, "%s sent %u...%u",
+                session,
+                seq - s->tcp.remote_start, seq + sent - s->tcp.remote_start);
+
+    args->ctx->forwarded++;
+    s->tcp.sent += sent;
+    s->tcp.remote_seq += sent;
+
+    if (sent < datalen) {
+        s->ready &= ~EPOLLOUT; // send buffer full
+        queue_forward(&s->tcp.forward, s->tcp.remote_seq, s->tcp.remote_seq,
+                      data + sent, datalen - sent, tcphdr->psh);
+    }
+
+    return 1;
 }
 
 int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions) {
@@ -111,11 +460,19 @@ int check_tcp_session(const struct arguments *args, struct ng_session *s,
     if (s->tcp.state == TCP_CLOSE && s->tcp.time + TCP_KEEP_TIMEOUT < now)
         return 1;
 
+    // Wake a parked session for its window probe
+    if (s->tcp.probe_due && get_ms() >= s->tcp.probe_due) {
+        s->tcp.probe_due = 0;
+        if (s->socket >= 0) {
+            s->ready_due = 0;
+            ready_session(args->ctx, s);
+        }
+    }
+
     return 0;
 }
 
-int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int epoll_fd) {
-    int recheck = 0;
+unsigned int get_tcp_interest(const struct ng_session *s, int *blocked) {
     unsigned int events = EPOLLERR;
 
     if (s->tcp.state == TCP_LISTEN) {
@@ -129,41 +486,122 @@ int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int
         // Check for incoming data
         if (get_send_window(&s->tcp) > 0)
             events = events | EPOLLIN;
-        else {
-            recheck = 1;
+        else if (s->ready & EPOLLIN)
+            *blocked = 1;
 
-            long long ms = get_ms();
-            if (ms - s->tcp.last_keep_alive > EPOLL_MIN_CHECK) {
-                s->tcp.last_keep_alive = ms;
+        // Check for outgoing data, partial sends wait for EPOLLOUT
+        if (get_forward_ready(&s->tcp.forward, s->tcp.remote_seq))
+            events = events | EPOLLOUT;
+    }
+
+    return events;
+}
+
+int check_tcp_ready(const struct arguments *args, struct ng_session *s,
+                    const int epoll_fd, long long *due) {
+    *due = 0;
+
+    // Retransmit on timeout with exponential backoff, also after the socket was closed
+    if (s->tcp.rto_due && get_ms() >= s->tcp.rto_due) {
+        log_android(ANDROID_LOG_WARN, "TCP retransmit timeout %u ms", s->tcp.rto);
+        if (retransmit_first(args, &s->tcp)) {
+            s->tcp.rto = (s->tcp.rto * 2 < TCP_RTO_MAX ? s->tcp.rto * 2 : TCP_RTO_MAX);
+            s->tcp.rto_due = get_ms() + s->tcp.rto;
+            s->tcp.recovering = 1;
+            s->tcp.recover = s->tcp.local_seq;
+            s->tcp.dupacks = 0;
+        } else
+            s->tcp.rto_due = 0;
+    }
+
+    if (flush_ack(args, &s->tcp))
+        s->tcp.time = time(NULL);
+
+    if (s->socket < 0) {
+        *due = get_tcp_due(&s->tcp);
+        return (*due != 0);
+    }
+
+    int blocked = 0;
+    unsigned int events = s->ready & get_tcp_interest(s, &blocked);
+    if (events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(struct epoll_event));
+        ev.events = events;
+        ev.data.ptr = s;
+        s->ready &= ~EPOLLERR;
+
+        check_tcp_socket(args, &ev, epoll_fd);
+        if (s->socket < 0) {
+            *due = get_tcp_due(&s->tcp);
+            return (*due != 0);
+        }
+
+        blocked = 0;
+        events = s->ready & get_tcp_interest(s, &blocked);
+    }
+
+    // Reopen a closed receive window, the socket signals EPOLLOUT when drained
+    int stalled = 0;
+    if ((s->tcp.state == TCP_ESTABLISHED || s->tcp.state == TCP_CLOSE_WAIT) &&
+        s->tcp.recv_window < s->tcp.mss) {
+        uint32_t window = get_receive_window(s);
+        if (window < s->tcp.mss) {
+            if (s->tcp.probe_backoff != 0 &&
+                get_ms() - s->tcp.last_keep_alive < s->tcp.probe_backoff)
+                stalled = 1; // parked, an EPOLLOUT edge comes earlier than the probe
+            else if (is_writable(s->socket)) {
+                // Below SEND_LOWAT already, no edge will come, so read the send queue back now,
+                // a socket which is not writable was armed by the poll to signal EPOLLOUT
+                s->tcp.unsent_stale = 1;
+                window = get_receive_window(s);
+                stalled = (window < s->tcp.mss); // poll once per probe
+            }
+        }
+
+        if (window >= s->tcp.mss) {
+            log_android(ANDROID_LOG_WARN, "Reopen recv window %u > %u",
+                        s->tcp.recv_window, window);
+            s->tcp.recv_window = window;
+            if (write_ack(args, &s->tcp) >= 0)
+                s->tcp.time = time(NULL);
+        } else
+            s->ready &= ~EPOLLOUT;
+    }
+
+    // Probe a zero send window with exponential backoff,
+    // the session waits on the deadline heap instead of the ready list
+    s->tcp.probe_due = 0;
+    if (blocked || stalled) {
+        long long ms = get_ms();
+        if (s->tcp.probe_backoff == 0) {
+            s->tcp.probe_backoff = TCP_PROBE_MIN;
+            s->tcp.last_keep_alive = ms;
+        } else if (ms - s->tcp.last_keep_alive >= s->tcp.probe_backoff) {
+            if (blocked) {
                 log_android(ANDROID_LOG_WARN, "Sending keep alive to update send window");
                 s->tcp.remote_seq--;
                 write_ack(args, &s->tcp);
                 s->tcp.remote_seq++;
             }
+            s->tcp.last_keep_alive = ms;
+            s->tcp.probe_backoff = (s->tcp.probe_backoff * 2 < TCP_PROBE_MAX
+                                    ? s->tcp.probe_backoff * 2 : TCP_PROBE_MAX);
         }
+        s->tcp.probe_due = s->tcp.last_keep_alive + s->tcp.probe_backoff;
+    } else
+        s->tcp.probe_backoff = 0;
 
-        // Check for outgoing data
-        if (s->tcp.forward != NULL) {
-            uint32_t buffer_size = get_receive_buffer(s);
-            if (s->tcp.forward->seq == s->tcp.remote_seq &&
-                s->tcp.forward->len - s->tcp.forward->sent < buffer_size)
-                events = events | EPOLLOUT;
-            else
-                recheck = 1;
-        }
-    }
+    *due = get_tcp_due(&s->tcp);
 
-    if (events != s->ev.events) {
-        s->ev.events = events;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->socket, &s->ev)) {
-            s->tcp.state = TCP_CLOSING;
-            log_android(ANDROID_LOG_ERROR, "epoll mod tcp error %d: %s", errno, strerror(errno));
-        } else
-            log_android(ANDROID_LOG_DEBUG, "epoll mod tcp socket %d in %d out %d",
-                        s->socket, (events & EPOLLIN) != 0, (events & EPOLLOUT) != 0);
-    }
+    if (events)
+        *due = 0; // more work now
 
-    return recheck;
+    // The retransmission buffer is kept while the session is busy
+    if (!events && !*due && s->tcp.unacked.count == 0)
+        clear_forward(&s->tcp.unacked);
+
+    return (events || *due);
 }
 
 uint32_t get_send_window(const struct tcp_session *cur) {
@@ -176,49 +614,65 @@ uint32_t get_send_window(const struct tcp_session *cur) {
 
     uint32_t total = (behind < cur->send_window ? cur->send_window - behind : 0);
 
+    // Unacknowledged data is kept for retransmission, up to a full window of the app
+    uint32_t room = (cur->unacked.buffered < cur->send_window
+                     ? cur->send_window - cur->unacked.buffered : 0);
+    if (total > room)
+        total = room;
+
     log_android(ANDROID_LOG_DEBUG, "Send window behind %u window %u total %u",
                 behind, cur->send_window, total);
 
     return total;
 }
 
-uint32_t get_receive_buffer(const struct ng_session *cur) {
+uint32_t get_receive_buffer(struct ng_session *cur) {
     if (cur->socket < 0)
         return 0;
 
-    // Get send buffer size
+    // Get send buffer size once
     // /proc/sys/net/core/wmem_default
-    int sendbuf = 0;
-    int sendbufsize = sizeof(sendbuf);
-    if (getsockopt(cur->socket, SOL_SOCKET, SO_SNDBUF, &sendbuf, (socklen_t *) &sendbufsize) < 0)
-        log_android(ANDROID_LOG_WARN, "getsockopt SO_RCVBUF %d: %s", errno, strerror(errno));
-
-    if (sendbuf == 0)
-        sendbuf = SEND_BUF_DEFAULT;
+    if (cur->tcp.sndbuf == 0) {
+        int sendbuf = 0;
+        int sendbufsize = sizeof(sendbuf);
+        if (getsockopt(cur->socket, SOL_SOCKET, SO_SNDBUF,
+                       &sendbuf, (socklen_t *) &sendbufsize) < 0)
+            log_android(ANDROID_LOG_WARN, "getsockopt SO_SNDBUF %d: %s", errno, strerror(errno));
+        cur->tcp.sndbuf = (uint32_t) (sendbuf > 0 ? sendbuf : SEND_BUF_DEFAULT);
+    }
 
-    // Get unsent data size
-    int unsent = 0;
-    if (ioctl(cur->socket, SIOCOUTQ, &unsent))
-        log_android(ANDROID_LOG_WARN, "ioctl SIOCOUTQ %d: %s", errno, strerror(errno));
+    // Unsent data is estimated from our sends and only read back when it could be stale
+#ifndef CHECK_SEND_QUEUE
+    if (cur->tcp.unsent_stale)
+#endif
+    {
+        int unsent = 0;
+        if (ioctl(cur->socket, SIOCOUTQ, &unsent))
+            log_android(ANDROID_LOG_WARN, "ioctl SIOCOUTQ %d: %s", errno, strerror(errno));
+#ifdef CHECK_SEND_QUEUE
+        if (!cur->tcp.unsent_stale && (uint32_t) unsent > cur->tcp.unsent)
+            log_android(ANDROID_LOG_ERROR, "Send queue %d > estimate %u",
+                        unsent, cur->tcp.unsent);
+#endif
+        cur->tcp.unsent = (uint32_t) unsent;
+        cur->tcp.unsent_stale = 0;
+    }
 
-    uint32_t total = (uint32_t) (unsent < sendbuf ? sendbuf - unsent : 0);
+    uint32_t total = (cur->tcp.unsent < cur->tcp.sndbuf ? cur->tcp.sndbuf - cur->tcp.unsent : 0);
 
     log_android(ANDROID_LOG_DEBUG, "Send buffer %u unsent %u total %u",
-                sendbuf, unsent, total);
+                cur->tcp.sndbuf, cur->tcp.unsent, total);
 
     return total;
 }
 
-uint32_t get_receive_window(const struct ng_session *cur) {
+uint32_t get_receive_window(struct ng_session *cur) {
     // Get data to forward size
-    uint32_t toforward = 0;
-    struct segment *q = cur->tcp.forward;
-    while (q != NULL) {
-        toforward += (q->len - q->sent);
-        q = q->next;
-    }
+    uint32_t toforward = cur->tcp.forward.buffered;
 
     uint32_t window = get_receive_buffer(cur);
+    if (window > cur->tcp.recv_budget)
+        window = cur->tcp.recv_budget;
 
     uint32_t max = ((uint32_t) 0xFFFF) << cur->tcp.recv_scale;
     if (window > max) {
@@ -301,13 +755,35 @@ void check_tcp_socket(const struct arguments *args,
 
                 write_icmp(args, &sicmp, (uint8_t *) &icmp, 8);
             }
+
+        // A middlebox might drop SYNs with data
+        if (s->tcp.state == TCP_LISTEN && s->tcp.syn_data > 0)
+            update_fastopen(&s->tcp, 0);
     } else {
         // Assume socket okay
         if (s->tcp.state == TCP_LISTEN) {
+            uint8_t oldsocks5 = s->tcp.socks5;
+
             // Check socket connect
             if (s->tcp.socks5 == SOCKS5_NONE) {
                 if (ev->events & EPOLLOUT) {
                     log_android(ANDROID_LOG_INFO, "%s connected", session);
+                    s->tcp.sndbuf = 0; // the kernel sizes the buffer on connect
+
+#ifdef TCPI_OPT_SYN_DATA
+                    // Data not accepted with the SYN is sent again by the kernel
+                    if (s->tcp.syn_data > 0) {
+                        struct tcp_info info;
+                        socklen_t infolen = sizeof(struct tcp_info);
+                        if (getsockopt(s->socket, SOL_TCP, TCP_INFO, &info, &infolen) == 0) {
+                            int accepted = ((info.tcpi_options & TCPI_OPT_SYN_DATA) != 0);
+                            log_android(accepted ? ANDROID_LOG_INFO : ANDROID_LOG_WARN,
+                                        "%s fast open data %u accepted %d",
+                                        session, s->tcp.syn_data, accepted);
+                            update_fastopen(&s->tcp, accepted);
+                        }
+                    }
+#endif
 
                     // https://tools.ietf.org/html/rfc1928
                     // https://tools.ietf.org/html/rfc1929
@@ -319,139 +795,67 @@ void check_tcp_socket(const struct arguments *args,
                 }
             } else {
                 if (ev->events & EPOLLIN) {
-                    uint8_t buffer[32];
-                    ssize_t bytes = recv(s->socket, buffer, sizeof(buffer), 0);
+                    // Replies are taken only when complete,
+                    // data of the destination following the replies is left in the socket
+                    uint8_t buffer[512];
+                    ssize_t bytes = recv(s->socket, buffer, sizeof(buffer), MSG_PEEK);
                     if (bytes < 0) {
-                        log_android(ANDROID_LOG_ERROR, "%s recv SOCKS5 error %d: %s",
-                                    session, errno, strerror(errno));
-                        write_rst(args, &s->tcp);
+                        if (errno == EAGAIN)
+                            s->ready &= ~EPOLLIN; // drained
+                        else {
+                            log_android(ANDROID_LOG_ERROR, "%s recv SOCKS5 error %d: %s",
+                                        session, errno, strerror(errno));
+                            write_rst(args, &s->tcp);
+                        }
                     } else {
-                        char *h = hex(buffer, (const size_t) bytes);
-                        log_android(ANDROID_LOG_INFO, "%s recv SOCKS5 %s", session, h);
-                        ng_free(h, __FILE__, __LINE__);
-
-                        if (s->tcp.socks5 == SOCKS5_HELLO &&
-                            bytes == 2 && buffer[0] == 5) {
-                            if (buffer[1] == 0)
-                                s->tcp.socks5 = SOCKS5_CONNECT;
-                            else if (buffer[1] == 2)
-                                s->tcp.socks5 = SOCKS5_AUTH;
-                            else {
-                                s->tcp.socks5 = 0;
-                                log_android(ANDROID_LOG_ERROR, "%s SOCKS5 auth %d not supported",
-                                            session, buffer[1]);
-                                write_rst(args, &s->tcp);
-                            }
-
-                        } else if (s->tcp.socks5 == SOCKS5_AUTH &&
-                                   bytes == 2 &&
-                                   (buffer[0] == 1 || buffer[0] == 5)) {
-                            if (buffer[1] == 0) {
-                                s->tcp.socks5 = SOCKS5_CONNECT;
-                                log_android(ANDROID_LOG_WARN, "%s SOCKS5 auth OK", session);
-                            } else {
-                                s->tcp.socks5 = 0;
-                                log_android(ANDROID_LOG_ERROR, "%s SOCKS5 auth error %d",
-                                            session, buffer[1]);
-                                write_rst(args, &s->tcp);
-                            }
-
-                        } else if (s->tcp.socks5 == SOCKS5_CONNECT &&
-                                   bytes == 6 + (s->tcp.version == 4 ? 4 : 16) &&
-                                   buffer[0] == 5) {
-                            if (buffer[1] == 0) {
-                                s->tcp.socks5 = SOCKS5_CONNECTED;
-                                log_android(ANDROID_LOG_WARN, "%s SOCKS5 connected", session);
-                            } else {
-                                s->tcp.socks5 = 0;
-                                log_android(ANDROID_LOG_ERROR, "%s SOCKS5 connect error %d",
-                                            session, buffer[1]);
-                                write_rst(args, &s->tcp);
-                                /*
-                                    0x00 = request granted
-                                    0x01 = general failure
-                                    0x02 = connection not allowed by ruleset
-                                    0x03 = network unreachable
-                                    0x04 = host unreachable
-                                    0x05 = connection refused by destination host
-                                    0x06 = TTL expired
-                                    0x07 = command not supported / protocol error
-                                    0x08 = address type not supported
-                                 */
-                            }
+                        if (loglevel <= ANDROID_LOG_INFO) {
+                            char *h = hex(buffer, (const size_t) bytes);
+                            log_android(ANDROID_LOG_INFO, "%s recv SOCKS5 %s", session, h);
+                            ng_free(h, __FILE__, __LINE__);
+                        }
 
-                        } else {
+                        int used = parse_socks5(session, &s->tcp.socks5, buffer, (size_t) bytes);
+                        if (used < 0 ||
+                            (s->tcp.socks5 != SOCKS5_CONNECTED &&
+                             (bytes == 0 || (s->ready & EPOLLRDHUP)))) {
+                            if (used >= 0)
+                                log_android(ANDROID_LOG_ERROR, "%s recv SOCKS5 state %d",
+                                            session, s->tcp.socks5);
                             s->tcp.socks5 = 0;
-                            log_android(ANDROID_LOG_ERROR, "%s recv SOCKS5 state %d",
-                                        session, s->tcp.socks5);
                             write_rst(args, &s->tcp);
+                        } else {
+                            if (used > 0 && recv(s->socket, buffer, (size_t) used, 0) != used)
+                                log_android(ANDROID_LOG_ERROR, "%s recv SOCKS5 %d error %d: %s",
+                                            session, used, errno, strerror(errno));
+                            // Partial replies are completed by new data
+                            if (s->tcp.socks5 != SOCKS5_CONNECTED ||
+                                (used == bytes && bytes < (ssize_t) sizeof(buffer) &&
+                                 !(s->ready & EPOLLRDHUP)))
+                                s->ready &= ~EPOLLIN; // drained
                         }
                     }
                 }
             }
 
-            if (s->tcp.socks5 == SOCKS5_HELLO) {
-                uint8_t buffer[4] = {5, 2, 0, 2};
-                char *h = hex(buffer, sizeof(buffer));
-                log_android(ANDROID_LOG_INFO, "%s sending SOCKS5 hello: %s",
-                            session, h);
-                ng_free(h, __FILE__, __LINE__);
-                ssize_t sent = send(s->socket, buffer, sizeof(buffer), MSG_NOSIGNAL);
-                if (sent < 0) {
-                    log_android(ANDROID_LOG_ERROR, "%s send SOCKS5 hello error %d: %s",
-                                session, errno, strerror(errno));
-                    write_rst(args, &s->tcp);
-                }
-
-            } else if (s->tcp.socks5 == SOCKS5_AUTH) {
-                uint8_t ulen = strlen(socks5_username);
-                uint8_t plen = strlen(socks5_password);
+            // Send the request for the next reply, all requests at once when pipelined
+            if (s->tcp.socks5 != oldsocks5 &&
+                (s->tcp.socks5 == SOCKS5_HELLO ||
+                 (!SOCKS5_PIPELINE &&
+                  (s->tcp.socks5 == SOCKS5_AUTH || s->tcp.socks5 == SOCKS5_CONNECT)))) {
                 uint8_t buffer[512];
-                *(buffer + 0) = 1; // Version
-                *(buffer + 1) = ulen;
-                memcpy(buffer + 2, socks5_username, ulen);
-                *(buffer + 2 + ulen) = plen;
-                memcpy(buffer + 2 + ulen + 1, socks5_password, plen);
-
-                size_t len = 2 + ulen + 1 + plen;
-
-                char *h = hex(buffer, len);
-                log_android(ANDROID_LOG_INFO, "%s sending SOCKS5 auth: %s",
-                            session, h);
-                ng_free(h, __FILE__, __LINE__);
-                ssize_t sent = send(s->socket, buffer, len, MSG_NOSIGNAL);
-                if (sent < 0) {
-                    log_android(ANDROID_LOG_ERROR,
-                                "%s send SOCKS5 connect error %d: %s",
-                                session, errno, strerror(errno));
-                    write_rst(args, &s->tcp);
-                }
+                size_t len = get_socks5_request(s->tcp.socks5, &s->tcp, buffer);
 
-            } else if (s->tcp.socks5 == SOCKS5_CONNECT) {
-                uint8_t buffer[22];
-                *(buffer + 0) = 5; // version
-                *(buffer + 1) = 1; // TCP/IP stream connection
-                *(buffer + 2) = 0; // reserved
-                *(buffer + 3) = (uint8_t) (s->tcp.version == 4 ? 1 : 4);
-                if (s->tcp.version == 4) {
-                    memcpy(buffer + 4, &s->tcp.daddr.ip4, 4);
-                    *((__be16 *) (buffer + 4 + 4)) = s->tcp.dest;
-                } else {
-                    memcpy(buffer + 4, &s->tcp.daddr.ip6, 16);
-                    *((__be16 *) (buffer + 4 + 16)) = s->tcp.dest;
+                if (loglevel <= ANDROID_LOG_INFO) {
+                    char *h = hex(buffer, len);
+                    log_android(ANDROID_LOG_INFO, "%s sending SOCKS5 state %d: %s",
+                                session, s->tcp.socks5, h);
+                    ng_free(h, __FILE__, __LINE__);
                 }
 
-                size_t len = (s->tcp.version == 4 ? 10 : 22);
-
-                char *h = hex(buffer, len);
-                log_android(ANDROID_LOG_INFO, "%s sending SOCKS5 connect: %s",
-                            session, h);
-                ng_free(h, __FILE__, __LINE__);
                 ssize_t sent = send(s->socket, buffer, len, MSG_NOSIGNAL);
                 if (sent < 0) {
-                    log_android(ANDROID_LOG_ERROR,
-                                "%s send SOCKS5 connect error %d: %s",
-                                session, errno, strerror(errno));
+                    log_android(ANDROID_LOG_ERROR, "%s send SOCKS5 state %d error %d: %s",
+                                session, s->tcp.socks5, errno, strerror(errno));
                     write_rst(args, &s->tcp);
                 }
 
@@ -467,29 +871,36 @@ void check_tcp_socket(const struct arguments *args,
 
             // Always forward data
             int fwd = 0;
+            int pushed = 0;
             if (ev->events & EPOLLOUT) {
                 // Forward data
-                uint32_t buffer_size = get_receive_buffer(s);
-                while (s->tcp.forward != NULL &&
-                       s->tcp.forward->seq == s->tcp.remote_seq &&
-                       s->tcp.forward->len - s->tcp.forward->sent < buffer_size) {
-                    log_android(ANDROID_LOG_DEBUG, "%s fwd %u...%u sent %u",
+                struct forward_queue *q = &s->tcp.forward;
+                while (get_forward_ready(q, s->tcp.remote_seq)) {
+                    // All contiguous data at once, the kernel takes what fits
+                    struct iovec iov[2];
+                    struct msghdr msg;
+                    memset(&msg, 0, sizeof(struct msghdr));
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = (size_t) peek_forward(q, iov);
+                    uint32_t len = (uint32_t) (iov[0].iov_len +
+                                               (msg.msg_iovlen > 1 ? iov[1].iov_len : 0));
+                    log_android(ANDROID_LOG_DEBUG, "%s fwd %u...%u",
                                 session,
-                                s->tcp.forward->seq - s->tcp.remote_start,
-                                s->tcp.forward->seq + s->tcp.forward->len - s->tcp.remote_start,
-                                s->tcp.forward->sent);
-
-                    ssize_t sent = send(s->socket,
-                                        s->tcp.forward->data + s->tcp.forward->sent,
-                                        s->tcp.forward->len - s->tcp.forward->sent,
-                                        (unsigned int) (MSG_NOSIGNAL | (s->tcp.forward->psh
-                                                                        ? 0
-                                                                        : MSG_MORE)));
+                                q->seq - s->tcp.remote_start,
+                                q->seq + len - s->tcp.remote_start);
+
+                    // Cork until pushed data
+                    int psh = (q->pushed && compare_u32(q->psh, q->seq + len) <= 0);
+                    ssize_t sent = sendmsg(s->socket, &msg,
+                                           (unsigned int) (MSG_NOSIGNAL | (psh ? 0 : MSG_MORE)));
+                    args->ctx->send_syscalls++;
                     if (sent < 0) {
                         log_android(ANDROID_LOG_ERROR, "%s send error %d: %s",
                                     session, errno, strerror(errno));
                         if (errno == EINTR || errno == EAGAIN) {
                             // Retry later
+                            if (errno == EAGAIN)
+                                s->ready &= ~EPOLLOUT;
                             break;
                         } else {
                             write_rst(args, &s->tcp);
@@ -497,36 +908,28 @@ void check_tcp_socket(const struct arguments *args,
                         }
                     } else {
                         fwd = 1;
-                        buffer_size -= sent;
+                        pushed |= (psh && sent == len);
                         s->tcp.sent += sent;
-                        s->tcp.forward->sent += sent;
+                        account_send(s, sent);
+                        s->tcp.remote_seq += sent;
+                        consume_forward(q, (uint32_t) sent);
 
-                        if (s->tcp.forward->len == s->tcp.forward->sent) {
-                            s->tcp.remote_seq = s->tcp.forward->seq + s->tcp.forward->sent;
-
-                            struct segment *p = s->tcp.forward;
-                            s->tcp.forward = s->tcp.forward->next;
-                            ng_free(p->data, __FILE__, __LINE__);
-                            ng_free(p, __FILE__, __LINE__);
-                        } else {
+                        if (sent < len) {
                             log_android(ANDROID_LOG_WARN,
                                         "%s partial send %u/%u",
-                                        session, s->tcp.forward->sent, s->tcp.forward->len);
+                                        session, sent, len);
+                            s->ready &= ~EPOLLOUT; // send buffer full
                             break;
                         }
                     }
                 }
 
                 // Log data buffered
-                struct segment *seg = s->tcp.forward;
-                while (seg != NULL) {
-                    log_android(ANDROID_LOG_WARN, "%s queued %u...%u sent %u",
+                for (int i = 0; i < q->count; i++)
+                    log_android(ANDROID_LOG_WARN, "%s queued %u...%u",
                                 session,
-                                seg->seq - s->tcp.remote_start,
-                                seg->seq + seg->len - s->tcp.remote_start,
-                                seg->sent);
-                    seg = seg->next;
-                }
+                                q->range[i].start - s->tcp.remote_start,
+                                q->range[i].end - s->tcp.remote_start);
             }
 
             // Get receive window
@@ -537,15 +940,17 @@ void check_tcp_socket(const struct arguments *args,
                 log_android(ANDROID_LOG_WARN, "%s recv window %u > %u",
                             session, prev, window);
 
-            // Acknowledge forwarded data
-            if (fwd || (prev == 0 && window > 0)) {
-                if (fwd && s->tcp.forward == NULL && s->tcp.state == TCP_CLOSE_WAIT) {
-                    log_android(ANDROID_LOG_WARN, "%s confirm FIN", session);
-                    s->tcp.remote_seq++; // remote FIN
-                }
+            // Acknowledge forwarded data, a reopened window or a FIN now
+            if (fwd && s->tcp.forward.count == 0 && s->tcp.state == TCP_CLOSE_WAIT) {
+                log_android(ANDROID_LOG_WARN, "%s confirm FIN", session);
+                s->tcp.remote_seq++; // remote FIN
                 if (write_ack(args, &s->tcp) >= 0)
                     s->tcp.time = time(NULL);
-            }
+            } else if (prev == 0 && window > 0) {
+                if (write_ack(args, &s->tcp) >= 0)
+                    s->tcp.time = time(NULL);
+            } else if (fwd)
+                delay_ack(&s->tcp, s->tcp.remote_seq - oldremote, pushed);
 
             if (s->tcp.state == TCP_ESTABLISHED || s->tcp.state == TCP_CLOSE_WAIT) {
                 // Check socket read
@@ -555,10 +960,19 @@ void check_tcp_socket(const struct arguments *args,
                 if ((ev->events & EPOLLIN) && send_window > 0) {
                     s->tcp.time = time(NULL);
 
-                    uint32_t buffer_size = (send_window > s->tcp.mss
-                                            ? s->tcp.mss : send_window);
-                    uint8_t *buffer = ng_malloc(buffer_size, "tcp socket");
-                    ssize_t bytes = recv(s->socket, buffer, (size_t) buffer_size, 0);
+                    // Read up to the send window at once and write it as MSS sized segments,
+                    // the window also accounts for the headers of the extra segments
+                    uint32_t buffer_size = (send_window > TCP_RECV_MAX ? TCP_RECV_MAX : send_window);
+                    if (buffer_size > s->tcp.mss)
+                        buffer_size -= (buffer_size / s->tcp.mss) * 40;
+                    // Read into the retransmission queue
+                    struct iovec iov[2];
+                    int parts = extend_forward(&s->tcp.unacked, s->tcp.local_seq, buffer_size, iov);
+                    ssize_t bytes = readv(s->socket, iov, parts);
+                    if ((bytes < 0 && errno == EAGAIN) ||
+                        (bytes > 0 && bytes < (ssize_t) buffer_size &&
+                         !(s->ready & EPOLLRDHUP)))
+                        s->ready &= ~EPOLLIN; // drained, eof is still to be read after RDHUP
                     if (bytes < 0) {
                         // Socket error
                         log_android(ANDROID_LOG_ERROR, "%s recv error %d: %s",
@@ -569,11 +983,11 @@ void check_tcp_socket(const struct arguments *args,
                     } else if (bytes == 0) {
                         log_android(ANDROID_LOG_WARN, "%s recv eof", session);
 
-                        if (s->tcp.forward == NULL) {
-                            if (write_fin_ack(args, &s->tcp) >= 0) {
+                        if (s->tcp.forward.count == 0) {
+                            if (write_fin_ack(args, &s->tcp) >= 0)
                                 log_android(ANDROID_LOG_WARN, "%s FIN sent", session);
-                                s->tcp.local_seq++; // local FIN
-                            }
+                            s->tcp.local_seq++; // local FIN, written again on timeout
+                            sent_tcp(&s->tcp);
 
                             if (s->tcp.state == TCP_ESTABLISHED)
                                 s->tcp.state = TCP_FIN_WAIT1;
@@ -597,34 +1011,65 @@ void check_tcp_socket(const struct arguments *args,
                         log_android(ANDROID_LOG_DEBUG, "%s recv bytes %d", session, bytes);
                         s->tcp.received += bytes;
 
+                        append_forward(&s->tcp.unacked, (uint32_t) bytes);
+
                         // Process DNS response
                         if (ntohs(s->tcp.dest) == 53 && bytes > 2) {
                             ssize_t dlen = bytes - 2;
-                            parse_dns_response(args, s, buffer + 2, (size_t *) &dlen);
+                            if ((size_t) bytes <= iov[0].iov_len)
+                                parse_dns_response(args, s, (uint8_t *) iov[0].iov_base + 2,
+                                                   (size_t *) &dlen);
+                            else {
+                                uint8_t *response = get_packet_buffer((size_t) bytes, "tcp dns");
+                                memcpy(response, iov[0].iov_base, iov[0].iov_len);
+                                memcpy(response + iov[0].iov_len, iov[1].iov_base,
+                                       bytes - iov[0].iov_len);
+                                parse_dns_response(args, s, response + 2, (size_t *) &dlen);
+                                put_packet_buffer(response);
+                            }
                         }
 
-                        // Forward to tun
-                        if (write_data(args, &s->tcp, buffer, (size_t) bytes) >= 0) {
-                            s->tcp.local_seq += bytes;
+                        // Forward to tun, segments do not cross the end of the ring
+                        ssize_t offset = 0;
+                        while (offset < bytes) {
+                            size_t len = (size_t) (bytes - offset);
+                            uint8_t *data;
+                            if ((size_t) offset < iov[0].iov_len) {
+                                data = (uint8_t *) iov[0].iov_base + offset;
+                                if (len > iov[0].iov_len - offset)
+                                    len = iov[0].iov_len - offset;
+                            } else
+                                data = (uint8_t *) iov[1].iov_base + (offset - iov[0].iov_len);
+                            if (len > s->tcp.mss)
+                                len = s->tcp.mss;
+                            if (write_data(args, &s->tcp, data, len) < 0)
+                                break;
+                            s->tcp.local_seq += len;
                             s->tcp.unconfirmed++;
+                            offset += len;
                         }
+                        s->tcp.local_seq += (uint32_t) (bytes - offset); // written on timeout
+                        sent_tcp(&s->tcp);
                     }
-                    ng_free(buffer, __FILE__, __LINE__);
                 }
             }
         }
     }
 
+    // An ACK not sent with data yet
+    if (flush_ack(args, &s->tcp))
+        s->tcp.time = time(NULL);
+
     if (s->tcp.state != oldstate || s->tcp.local_seq != oldlocal ||
         s->tcp.remote_seq != oldremote)
         log_android(ANDROID_LOG_DEBUG, "%s new state", session);
 }
 
-jboolean handle_tcp(const struct arguments *args,
-                    const uint8_t *pkt, size_t length,
-                    const uint8_t *payload,
-                    int uid, int allowed, struct allowed *redirect,
-                    const int epoll_fd) {
+struct ng_session *handle_tcp(const struct arguments *args,
+                              const uint8_t *pkt, size_t length,
+                              const uint8_t *payload,
+                              int uid, int allowed, struct allowed *redirect,
+                              const int epoll_fd) {
     // Get headers
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -636,16 +1081,12 @@ jboolean handle_tcp(const struct arguments *args,
     const uint16_t datalen = (const uint16_t) (length - (data - pkt));
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_TCP &&
-             cur->tcp.version == version &&
-             cur->tcp.source == tcphdr->source && cur->tcp.dest == tcphdr->dest &&
-             (version == 4 ? cur->tcp.saddr.ip4 == ip4->saddr &&
-                             cur->tcp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->tcp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->tcp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args->ctx, IPPROTO_TCP, version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src,
+            tcphdr->source,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst,
+            tcphdr->dest);
 
     // Prepare logging
     char source[INET6_ADDRSTRLEN + 1];
@@ -687,7 +1128,7 @@ jboolean handle_tcp(const struct arguments *args,
 
     // Drop URG data
     if (tcphdr->urg)
-        return 1;
+        return cur;
 
     // Check session
     if (cur == NULL) {
@@ -696,6 +1137,9 @@ jboolean handle_tcp(const struct arguments *args,
             // http://www.iana.org/assignments/tcp-parameters/tcp-parameters.xhtml#tcp-parameters-1
             uint16_t mss = get_default_mss(version);
             uint8_t ws = 0;
+            int wsopt = 0;
+            int sackok = 0;
+            int tfo = 0;
             int optlen = tcpoptlen;
             uint8_t *options = (uint8_t *) tcpoptions;
             while (optlen > 0) {
@@ -707,8 +1151,16 @@ jboolean handle_tcp(const struct arguments *args,
                 if (kind == 2 && len == 4)
                     mss = ntohs(*((uint16_t *) (options + 2)));
 
-                else if (kind == 3 && len == 3)
+                else if (kind == 3 && len == 3) {
                     ws = *(options + 2);
+                    wsopt = 1;
+                }
+
+                else if (kind == 4 && len == 2)
+                    sackok = 1;
+
+                else if (kind == 34 && len >= 2)
+                    tfo = 1;
 
                 if (kind == 1) {
                     optlen--;
@@ -720,7 +1172,7 @@ jboolean handle_tcp(const struct arguments *args,
             }
 
             log_android(ANDROID_LOG_WARN, "%s new session mss %u ws %u window %u",
-                        packet, mss, ws, ntohs(tcphdr->window) << ws);
+                        packet, mss, ws, ntohs(tcphdr->window));
 
             // Register session
             struct ng_session *s = ng_malloc(sizeof(struct ng_session), "tcp session");
@@ -730,18 +1182,43 @@ jboolean handle_tcp(const struct arguments *args,
             s->tcp.uid = uid;
             s->tcp.version = version;
             s->tcp.mss = mss;
-            s->tcp.recv_scale = ws;
+            // https://tools.ietf.org/html/rfc7323#section-2.2
+            // Our scale is independent of the peer's, but neither side scales without the option
+            s->tcp.recv_scale = (wsopt ? get_receive_scale() : 0);
             s->tcp.send_scale = ws;
-            s->tcp.send_window = ((uint32_t) ntohs(tcphdr->window)) << s->tcp.send_scale;
+            s->tcp.sack = sackok;
+            s->tcp.syn_data = 0;
+            s->tcp.recv_budget = RECV_WINDOW_INIT;
+            s->tcp.recv_period = ntohl(tcphdr->seq) + 1 + RECV_WINDOW_INIT;
+            s->tcp.recv_limited = 0;
+            s->tcp.send_window = ntohs(tcphdr->window); // not scaled in a SYN
             s->tcp.unconfirmed = 0;
             s->tcp.remote_seq = ntohl(tcphdr->seq); // ISN remote
             s->tcp.local_seq = (uint32_t) rand(); // ISN local
             s->tcp.remote_start = s->tcp.remote_seq;
             s->tcp.local_start = s->tcp.local_seq;
-            s->tcp.acked = 0;
+            s->tcp.acked = s->tcp.local_seq;
             s->tcp.last_keep_alive = 0;
+            s->tcp.probe_backoff = 0;
+            s->tcp.probe_due = 0;
+            s->tcp.srtt = 0;
+            s->tcp.rttvar = 0;
+            s->tcp.rto = TCP_RTO_INIT;
+            s->tcp.rto_due = 0;
+            s->tcp.rtt_time = 0;
+            s->tcp.rtt_seq = 0;
+            s->tcp.recover = 0;
+            s->tcp.rexmit = 0;
+            s->tcp.sacked_count = 0;
+            s->tcp.ack_bytes = 0;
+            s->tcp.ack_due = 0;
+            s->tcp.recovering = 0;
+            s->tcp.dupacks = 0;
             s->tcp.sent = 0;
             s->tcp.received = 0;
+            s->tcp.sndbuf = 0;
+            s->tcp.unsent = 0;
+            s->tcp.unsent_stale = 0;
 
             if (version == 4) {
                 s->tcp.saddr.ip4 = (__be32) ip4->saddr;
@@ -755,27 +1232,38 @@ jboolean handle_tcp(const struct arguments *args,
             s->tcp.dest = tcphdr->dest;
             s->tcp.state = TCP_LISTEN;
             s->tcp.socks5 = SOCKS5_NONE;
-            s->tcp.forward = NULL;
-            s->next = NULL;
+            // Offer a cookie only when open_tcp_socket will try SYN data upstream
+#ifdef MSG_FASTOPEN
+            s->tcp.fastopen = (tfo && allowed && !(*socks5_addr && socks5_port) &&
+                               check_fastopen(&s->tcp));
+#else
+            s->tcp.fastopen = 0;
+#endif
+            memset(&s->tcp.forward, 0, sizeof(struct forward_queue));
+            memset(&s->tcp.unacked, 0, sizeof(struct forward_queue));
+            init_header_template(&s->tcp.header, version, IPPROTO_TCP,
+                                 &s->tcp.daddr, s->tcp.dest, &s->tcp.saddr, s->tcp.source);
 
             if (datalen) {
                 log_android(ANDROID_LOG_WARN, "%s SYN data", packet);
-                s->tcp.forward = ng_malloc(sizeof(struct segment), "syn segment");
-                s->tcp.forward->seq = s->tcp.remote_seq;
-                s->tcp.forward->len = datalen;
-                s->tcp.forward->sent = 0;
-                s->tcp.forward->psh = tcphdr->psh;
-                s->tcp.forward->data = ng_malloc(datalen, "syn segment data");
-                memcpy(s->tcp.forward->data, data, datalen);
-                s->tcp.forward->next = NULL;
+                // The data follows the SYN
+                if (insert_forward(&s->tcp.forward, s->tcp.remote_seq + 1, s->tcp.remote_seq + 1,
+                                   data, datalen, tcphdr->psh,
+                                   get_segment_checksum(&s->tcp, tcphdr, datalen)) < 0) {
+                    log_android(ANDROID_LOG_WARN, "%s invalid checksum", packet);
+                    clear_forward(&s->tcp.forward);
+                    ng_free(s, __FILE__, __LINE__);
+                    return NULL;
+                }
             }
 
             // Open socket
-            s->socket = open_tcp_socket(args, &s->tcp, redirect);
+            s->socket = open_tcp_socket(args, &s->tcp, redirect, allowed);
             if (s->socket < 0) {
                 // Remote might retry
+                clear_forward(&s->tcp.forward);
                 ng_free(s, __FILE__, __LINE__);
-                return 0;
+                return NULL;
             }
 
             s->tcp.recv_window = get_receive_window(s);
@@ -785,14 +1273,14 @@ jboolean handle_tcp(const struct arguments *args,
 
             // Monitor events
             memset(&s->ev, 0, sizeof(struct epoll_event));
-            s->ev.events = EPOLLOUT | EPOLLERR;
+            s->ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLET;
             s->ev.data.ptr = s;
             if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
                 log_android(ANDROID_LOG_ERROR, "epoll add tcp error %d: %s",
                             errno, strerror(errno));
 
-            s->next = args->ctx->ng_session;
-            args->ctx->ng_session = s;
+            add_session(args->ctx, s);
+            cur = s;
 
             if (!allowed) {
                 log_android(ANDROID_LOG_WARN, "%s resetting blocked session", packet);
@@ -817,9 +1305,11 @@ jboolean handle_tcp(const struct arguments *args,
 
             rst.source = tcphdr->source;
             rst.dest = tcphdr->dest;
+            init_header_template(&rst.header, version, IPPROTO_TCP,
+                                 &rst.daddr, rst.dest, &rst.saddr, rst.source);
 
             write_rst(args, &rst);
-            return 0;
+            return NULL;
         }
     } else {
         char session[250];
@@ -835,7 +1325,7 @@ jboolean handle_tcp(const struct arguments *args,
         if (cur->tcp.state == TCP_CLOSING || cur->tcp.state == TCP_CLOSE) {
             log_android(ANDROID_LOG_WARN, "%s was closed", session);
             write_rst(args, &cur->tcp);
-            return 0;
+            return cur;
         } else {
             int oldstate = cur->tcp.state;
             uint32_t oldlocal = cur->tcp.local_seq;
@@ -845,9 +1335,21 @@ jboolean handle_tcp(const struct arguments *args,
 
             if (!tcphdr->syn)
                 cur->tcp.time = time(NULL);
+            uint32_t oldwindow = cur->tcp.send_window;
+            uint32_t oldacked = cur->tcp.acked;
             cur->tcp.send_window = ((uint32_t) ntohs(tcphdr->window)) << cur->tcp.send_scale;
             cur->tcp.unconfirmed = 0;
 
+            // Release acknowledged data and recover lost data
+            if (tcphdr->ack && !tcphdr->syn && !tcphdr->rst) {
+                struct forward_range sack[TCP_SACK_BLOCKS];
+                int sacks = (cur->tcp.sack ? get_sack_blocks(tcpoptions, tcpoptlen, sack) : 0);
+                check_tcp_ack(args, &cur->tcp, ntohl(tcphdr->ack_seq),
+                              datalen == 0 && !tcphdr->fin &&
+                              cur->tcp.send_window == oldwindow,
+                              sack, sacks);
+            }
+
             // Do not change the order of the conditions
 
             // Queue data to forward
@@ -855,14 +1357,28 @@ jboolean handle_tcp(const struct arguments *args,
                 if (cur->socket < 0) {
                     log_android(ANDROID_LOG_ERROR, "%s data while local closed", session);
                     write_rst(args, &cur->tcp);
-                    return 0;
+                    return cur;
                 }
                 if (cur->tcp.state == TCP_CLOSE_WAIT) {
                     log_android(ANDROID_LOG_ERROR, "%s data while remote closed", session);
                     write_rst(args, &cur->tcp);
-                    return 0;
+                    return cur;
+                }
+                tune_receive_window(&cur->tcp, ntohl(tcphdr->seq), datalen);
+                int direct = send_tcp(args, tcphdr, session, cur, data, datalen);
+                if (direct == 0) {
+                    queue_tcp(args, tcphdr, session, &cur->tcp, data, datalen);
+                    // https://tools.ietf.org/html/rfc5681#section-4.2
+                    // Acknowledge out-of-order and duplicate data now, with SACK blocks
+                    if (ntohl(tcphdr->seq) != cur->tcp.remote_seq && !tcphdr->fin)
+                        if (write_ack(args, &cur->tcp) >= 0)
+                            cur->tcp.time = time(NULL);
+                } else if (direct > 0 && !tcphdr->fin && cur->tcp.remote_seq != oldremote) {
+                    // A FIN is acknowledged below
+                    delay_ack(&cur->tcp, cur->tcp.remote_seq - oldremote, tcphdr->psh);
+                    if (flush_ack(args, &cur->tcp))
+                        cur->tcp.time = time(NULL);
                 }
-                queue_tcp(args, tcphdr, session, &cur->tcp, data, datalen);
             }
 
             if (tcphdr->rst /* +ACK */) {
@@ -870,17 +1386,22 @@ jboolean handle_tcp(const struct arguments *args,
                 // http://tools.ietf.org/html/rfc1122#page-87
                 log_android(ANDROID_LOG_WARN, "%s received reset", session);
                 cur->tcp.state = TCP_CLOSING;
-                return 0;
+                return cur;
             } else {
                 if (!tcphdr->ack || ntohl(tcphdr->ack_seq) == cur->tcp.local_seq) {
                     if (tcphdr->syn) {
                         log_android(ANDROID_LOG_WARN, "%s repeated SYN", session);
-                        // The socket is probably not opened yet
+                        // The socket is probably not opened yet, or the SYN-ACK was lost
+                        if (cur->tcp.state == TCP_SYN_RECV) {
+                            cur->tcp.local_seq--;
+                            write_syn_ack(args, &cur->tcp);
+                            cur->tcp.local_seq++;
+                        }
 
                     } else if (tcphdr->fin /* +ACK */) {
                         if (cur->tcp.state == TCP_ESTABLISHED) {
                             log_android(ANDROID_LOG_WARN, "%s FIN received", session);
-                            if (cur->tcp.forward == NULL) {
+                            if (cur->tcp.forward.count == 0) {
                                 cur->tcp.remote_seq++; // remote FIN
                                 if (write_ack(args, &cur->tcp) >= 0)
                                     cur->tcp.state = TCP_CLOSE_WAIT;
@@ -896,7 +1417,7 @@ jboolean handle_tcp(const struct arguments *args,
                                 cur->tcp.state = TCP_CLOSE;
                         } else {
                             log_android(ANDROID_LOG_ERROR, "%s invalid FIN", session);
-                            return 0;
+                            return cur;
                         }
 
                     } else if (tcphdr->ack) {
@@ -916,11 +1437,11 @@ jboolean handle_tcp(const struct arguments *args,
                             // Do nothing
                         } else {
                             log_android(ANDROID_LOG_ERROR, "%s invalid state", session);
-                            return 0;
+                            return cur;
                         }
                     } else {
                         log_android(ANDROID_LOG_ERROR, "%s unknown packet", session);
-                        return 0;
+                        return cur;
                     }
                 } else {
                     uint32_t ack = ntohl(tcphdr->ack_seq);
@@ -938,24 +1459,24 @@ jboolean handle_tcp(const struct arguments *args,
                             log_android(ANDROID_LOG_WARN, "%s keep alive", session);
 
                     } else if (compare_u32(ack, cur->tcp.local_seq) < 0) {
-                        if (compare_u32(ack, cur->tcp.acked) <= 0)
+                        if (compare_u32(ack, oldacked) <= 0)
                             log_android(
-                                    ack == cur->tcp.acked ? ANDROID_LOG_WARN : ANDROID_LOG_ERROR,
+                                    ack == oldacked ? ANDROID_LOG_WARN : ANDROID_LOG_ERROR,
                                     "%s repeated ACK %u/%u",
                                     session,
                                     ack - cur->tcp.local_start,
-                                    cur->tcp.acked - cur->tcp.local_start);
+                                    oldacked - cur->tcp.local_start);
                         else {
                             log_android(ANDROID_LOG_WARN, "%s previous ACK %u",
                                         session, ack - cur->tcp.local_seq);
                             cur->tcp.acked = ack;
                         }
 
-                        return 1;
+                        return cur;
                     } else {
                         log_android(ANDROID_LOG_ERROR, "%s future ACK", session);
                         write_rst(args, &cur->tcp);
-                        return 0;
+                        return cur;
                     }
                 }
             }
@@ -971,105 +1492,105 @@ jboolean handle_tcp(const struct arguments *args,
         }
     }
 
-    return 1;
+    return cur;
 }
 
 void queue_tcp(const struct arguments *args,
                const struct tcphdr *tcphdr,
                const char *session, struct tcp_session *cur,
                const uint8_t *data, uint16_t datalen) {
-    uint32_t seq = ntohl(tcphdr->seq);
-    if (compare_u32(seq, cur->remote_seq) < 0)
+    uint32_t seq = ntohl(tcphdr->seq) + tcphdr->syn; // Data follows a retransmitted SYN
+    if (compare_u32(seq + datalen, cur->remote_seq) <= 0)
         log_android(ANDROID_LOG_WARN, "%s already forwarded %u..%u",
                     session,
                     seq - cur->remote_start, seq + datalen - cur->remote_start);
     else {
-        struct segment *p = NULL;
-        struct segment *s = cur->forward;
-        while (s != NULL && compare_u32(s->seq, seq) < 0) {
-            p = s;
-            s = s->next;
-        }
-
-        if (s == NULL || compare_u32(s->seq, seq) > 0) {
-            log_android(ANDROID_LOG_DEBUG, "%s queuing %u...%u",
+        log_android(ANDROID_LOG_DEBUG, "%s queuing %u...%u",
+                    session,
+                    seq - cur->remote_start, seq + datalen - cur->remote_start);
+        int queued = insert_forward(&cur->forward, cur->remote_seq, seq, data, datalen,
+                                    tcphdr->psh, get_segment_checksum(cur, tcphdr, datalen));
+        if (queued > 0)
+            args->ctx->forwarded++;
+        else if (queued < 0)
+            log_android(ANDROID_LOG_WARN, "%s invalid checksum", session);
+        else if (queued == 0)
+            log_android(ANDROID_LOG_WARN, "%s not queued %u..%u ranges %d",
                         session,
-                        seq - cur->remote_start, seq + datalen - cur->remote_start);
-            struct segment *n = ng_malloc(sizeof(struct segment), "tcp segment");
-            n->seq = seq;
-            n->len = datalen;
-            n->sent = 0;
-            n->psh = tcphdr->psh;
-            n->data = ng_malloc(datalen, "tcp segment");
-            memcpy(n->data, data, datalen);
-            n->next = s;
-            if (p == NULL)
-                cur->forward = n;
-            else
-                p->next = n;
-        } else if (s != NULL && s->seq == seq) {
-            if (s->len == datalen)
-                log_android(ANDROID_LOG_WARN, "%s segment already queued %u..%u",
-                            session,
-                            s->seq - cur->remote_start, s->seq + s->len - cur->remote_start);
-            else if (s->len < datalen) {
-                log_android(ANDROID_LOG_WARN, "%s segment smaller %u..%u > %u",
-                            session,
-                            s->seq - cur->remote_start, s->seq + s->len - cur->remote_start,
-                            s->seq + datalen - cur->remote_start);
-                ng_free(s->data, __FILE__, __LINE__);
-                s->len = datalen;
-                s->data = ng_malloc(datalen, "tcp segment smaller");
-                memcpy(s->data, data, datalen);
-            } else {
-                log_android(ANDROID_LOG_ERROR, "%s segment larger %u..%u < %u",
-                            session,
-                            s->seq - cur->remote_start, s->seq + s->len - cur->remote_start,
-                            s->seq + datalen - cur->remote_start);
-                ng_free(s->data, __FILE__, __LINE__);
-                s->len = datalen;
-                s->data = ng_malloc(datalen, "tcp segment larger");
-                memcpy(s->data, data, datalen);
-            }
-        }
+                        seq - cur->remote_start, seq + datalen - cur->remote_start,
+                        cur->forward.count);
     }
 }
 
-int open_tcp_socket(const struct arguments *args,
-                    const struct tcp_session *cur, const struct allowed *redirect) {
-    int sock;
-    int version;
-    if (redirect == NULL) {
-        if (*socks5_addr && socks5_port)
-            version = (strstr(socks5_addr, ":") == NULL ? 4 : 6);
-        else
-            version = cur->version;
-    } else
-        version = (strstr(redirect->raddr, ":") == NULL ? 4 : 6);
-
+int create_tcp_socket(const struct arguments *args, int version) {
     // Get TCP socket
+    int sock;
     if ((sock = socket(version == 4 ? PF_INET : PF_INET6, SOCK_STREAM, 0)) < 0) {
         log_android(ANDROID_LOG_ERROR, "socket error %d: %s", errno, strerror(errno));
         return -1;
     }
 
     // Protect
-    if (protect_socket(args, sock) < 0)
+    if (protect_socket(args, sock) < 0) {
+        close(sock);
         return -1;
+    }
 
     int on = 1;
     if (setsockopt(sock, SOL_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
         log_android(ANDROID_LOG_ERROR, "setsockopt TCP_NODELAY error %d: %s",
                     errno, strerror(errno));
 
+    // Signal EPOLLOUT only when most data was sent, to reopen the receive window
+    int lowat = SEND_LOWAT;
+    if (setsockopt(sock, SOL_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+        log_android(ANDROID_LOG_WARN, "setsockopt TCP_NOTSENT_LOWAT error %d: %s",
+                    errno, strerror(errno));
+
     // Set non blocking
     int flags = fcntl(sock, F_GETFL, 0);
     if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
         log_android(ANDROID_LOG_ERROR, "fcntl socket O_NONBLOCK error %d: %s",
                     errno, strerror(errno));
+        close(sock);
         return -1;
     }
 
+    return sock;
+}
+
+int open_tcp_socket(const struct arguments *args,
+                    struct tcp_session *cur, const struct allowed *redirect, int fastopen) {
+    int version;
+    if (redirect == NULL) {
+        if (*socks5_addr && socks5_port)
+            version = (strstr(socks5_addr, ":") == NULL ? 4 : 6);
+        else
+            version = cur->version;
+    } else
+        version = (strstr(redirect->raddr, ":") == NULL ? 4 : 6);
+
+    // A pooled proxy connection needs the CONNECT request only
+    if (redirect == NULL && *socks5_addr && socks5_port) {
+        int sock = take_socks5_pool(args);
+        if (sock >= 0) {
+            uint8_t buffer[32];
+            size_t len = get_socks5_request(SOCKS5_CONNECT, cur, buffer);
+            if (send(sock, buffer, len, MSG_NOSIGNAL) == (ssize_t) len) {
+                log_android(ANDROID_LOG_INFO, "TCP%d SOCKS5 pool socket %d", version, sock);
+                cur->socks5 = SOCKS5_CONNECT;
+                return sock;
+            }
+            log_android(ANDROID_LOG_ERROR, "send SOCKS5 pool connect error %d: %s",
+                        errno, strerror(errno));
+            close(sock);
+        }
+    }
+
+    int sock = create_tcp_socket(args, version);
+    if (sock < 0)
+        return -1;
+
     // Build target address
     struct sockaddr_in addr4;
     struct sockaddr_in6 addr6;
@@ -1113,26 +1634,70 @@ int open_tcp_socket(const struct arguments *args,
         }
     }
 
+    const struct sockaddr *addr = (version == 4 ? (const struct sockaddr *) &addr4
+                                                : (const struct sockaddr *) &addr6);
+    socklen_t addrlen = (socklen_t) (version == 4
+                                     ? sizeof(struct sockaddr_in)
+                                     : sizeof(struct sockaddr_in6));
+
+#ifdef MSG_FASTOPEN
+    // https://tools.ietf.org/html/rfc7413
+    // Send the SYN data with the SYN, without a cookie the kernel connects and requests one,
+    // the SOCKS5 greeting comes first and would not save a round trip
+    struct iovec iov[2];
+    if (fastopen && !(*socks5_addr && socks5_port) &&
+        get_forward_ready(&cur->forward, cur->remote_seq + 1) &&
+        peek_forward(&cur->forward, iov) &&
+        check_fastopen(cur)) {
+        ssize_t sent = sendto(sock, iov[0].iov_base, iov[0].iov_len,
+                              MSG_FASTOPEN | MSG_NOSIGNAL, addr, addrlen);
+        args->ctx->send_syscalls++;
+        if (sent > 0) {
+            log_android(ANDROID_LOG_INFO, "TCP%d fast open data %d", version, sent);
+            args->ctx->forwarded++;
+            args->ctx->fastopen++;
+            cur->syn_data = (uint32_t) sent;
+            cur->sent += sent;
+            cur->unsent = (uint32_t) sent;
+            cur->unsent_stale = 1;
+            cur->remote_seq += sent; // acknowledged with the SYN
+            consume_forward(&cur->forward, (uint32_t) sent);
+            return sock;
+        }
+        if (errno == EINPROGRESS)
+            return sock;
+        if (errno != EOPNOTSUPP && errno != ENOPROTOOPT) {
+            log_android(ANDROID_LOG_ERROR, "sendto fast open error %d: %s",
+                        errno, strerror(errno));
+            close(sock);
+            return -1;
+        }
+    }
+#endif
+
     // Initiate connect
-    int err = connect(sock,
-                      (version == 4 ? (const struct sockaddr *) &addr4
-                                    : (const struct sockaddr *) &addr6),
-                      (socklen_t) (version == 4
-                                   ? sizeof(struct sockaddr_in)
-                                   : sizeof(struct sockaddr_in6)));
+    int err = connect(sock, addr, addrlen);
     if (err < 0 && errno != EINPROGRESS) {
         log_android(ANDROID_LOG_ERROR, "connect error %d: %s", errno, strerror(errno));
+        close(sock);
         return -1;
     }
 
     return sock;
 }
 
+// Every segment acknowledges the data received
+static void clear_ack(struct tcp_session *cur) {
+    cur->ack_bytes = 0;
+    cur->ack_due = 0;
+}
+
 int write_syn_ack(const struct arguments *args, struct tcp_session *cur) {
     if (write_tcp(args, cur, NULL, 0, 1, 1, 0, 0) < 0) {
         cur->state = TCP_CLOSING;
         return -1;
     }
+    clear_ack(cur);
     return 0;
 }
 
@@ -1141,6 +1706,7 @@ int write_ack(const struct arguments *args, struct tcp_session *cur) {
         cur->state = TCP_CLOSING;
         return -1;
     }
+    clear_ack(cur);
     return 0;
 }
 
@@ -1150,6 +1716,7 @@ int write_data(const struct arguments *args, struct tcp_session *cur,
         cur->state = TCP_CLOSING;
         return -1;
     }
+    clear_ack(cur);
     return 0;
 }
 
@@ -1158,6 +1725,7 @@ int write_fin_ack(const struct arguments *args, struct tcp_session *cur) {
         cur->state = TCP_CLOSING;
         return -1;
     }
+    clear_ack(cur);
     return 0;
 }
 
@@ -1176,92 +1744,49 @@ void write_rst(const struct arguments *args, struct tcp_session *cur) {
 ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
                   const uint8_t *data, size_t datalen,
                   int syn, int ack, int fin, int rst) {
-    size_t len;
-    u_int8_t *buffer;
-    struct tcphdr *tcp;
-    uint16_t csum;
-    char source[INET6_ADDRSTRLEN + 1];
-    char dest[INET6_ADDRSTRLEN + 1];
-
-    // Build packet
-    int optlen = (syn ? 4 + 3 + 1 : 0);
-    uint8_t *options;
+    const struct header_template *header = &cur->header;
+    char dest[INET6_ADDRSTRLEN + 1] = "";
+
+    // Out-of-order data is reported with the acknowledgement
+    struct forward_range sack[TCP_SACK_BLOCKS];
+    int sacks = 0;
+    if (cur->sack && ack && !syn && !rst)
+        sacks = get_forward_sack(&cur->forward, sack, TCP_SACK_BLOCKS);
+
+    // Build packet from the session header
+    int optlen = (syn
+                  ? 4 + 3 + 1 + (cur->sack ? 4 : 0) + (cur->fastopen ? 4 + TCP_FASTOPEN_COOKIE : 0)
+                  : (sacks ? 2 + 2 + sacks * 8 : 0));
+    size_t len = header->len + optlen + datalen;
+    uint8_t *buffer = get_packet_buffer(len, "tcp write");
+    memcpy(buffer, header->data, header->len);
+    struct tcphdr *tcp = (struct tcphdr *) (buffer + header->iplen);
+    uint8_t *options = buffer + header->len;
+
+    // Patch length
+    __be16 tcplen = htons(len - header->iplen);
     if (cur->version == 4) {
-        len = sizeof(struct iphdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = ng_malloc(len, "tcp write4");
         struct iphdr *ip4 = (struct iphdr *) buffer;
-        tcp = (struct tcphdr *) (buffer + sizeof(struct iphdr));
-        options = buffer + sizeof(struct iphdr) + sizeof(struct tcphdr);
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr) + sizeof(struct tcphdr) + optlen, data, datalen);
-
-        // Build IP4 header
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
         ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_TCP;
-        ip4->saddr = cur->daddr.ip4;
-        ip4->daddr = cur->saddr.ip4;
-
-        // Calculate IP4 checksum
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-
-        // Calculate TCP4 checksum
-        struct ippseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ippseudo));
-        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
-        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
-        pseudo.ippseudo_p = ip4->protocol;
-        pseudo.ippseudo_len = htons(sizeof(struct tcphdr) + optlen + datalen);
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
+        ip4->check = ~calc_checksum(header->ip_sum, (uint8_t *) &ip4->tot_len, 2);
     } else {
-        len = sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = ng_malloc(len, "tcp write 6");
         struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        tcp = (struct tcphdr *) (buffer + sizeof(struct ip6_hdr));
-        options = buffer + sizeof(struct ip6_hdr) + sizeof(struct tcphdr);
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + optlen, data, datalen);
-
-        // Build IP6 header
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_TCP;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = 0x60;
-        memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-
-        // Calculate TCP6 checksum
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = tcplen;
     }
 
-
-    // Build TCP header
-    memset(tcp, 0, sizeof(struct tcphdr));
-    tcp->source = cur->dest;
-    tcp->dest = cur->source;
+    // Patch TCP header
     tcp->seq = htonl(cur->local_seq);
-    tcp->ack_seq = htonl((uint32_t) (cur->remote_seq));
+    tcp->ack_seq = (ack ? htonl((uint32_t) (cur->remote_seq)) : 0);
     tcp->doff = (__u16) ((sizeof(struct tcphdr) + optlen) >> 2);
     tcp->syn = (__u16) syn;
     tcp->ack = (__u16) ack;
     tcp->fin = (__u16) fin;
     tcp->rst = (__u16) rst;
-    tcp->window = htons(cur->recv_window >> cur->recv_scale);
-
-    if (!tcp->ack)
-        tcp->ack_seq = 0;
+    // The window of a SYN is never scaled
+    if (syn)
+        tcp->window = htons(cur->recv_window < 0xFFFF ? cur->recv_window : 0xFFFF);
+    else
+        tcp->window = htons(cur->recv_window >> cur->recv_scale);
 
     // TCP options
     if (syn) {
@@ -1273,50 +1798,64 @@ ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
         *(options + 5) = 3; // total option length
         *(options + 6) = cur->recv_scale;
 
-        *(options + 7) = 0; // End, padding
+        uint8_t *opt = options + 7;
+        if (cur->sack) {
+            *(opt++) = 1; // NOP
+            *(opt++) = 4; // SACK permitted
+            *(opt++) = 2; // total option length
+        }
+        if (cur->fastopen) {
+            *(opt++) = 1; // NOP
+            *(opt++) = 34; // TCP Fast Open cookie
+            *(opt++) = 2 + TCP_FASTOPEN_COOKIE; // total option length
+            memcpy(opt, get_fastopen_cookie(), TCP_FASTOPEN_COOKIE);
+            opt += TCP_FASTOPEN_COOKIE;
+        }
+        memset(opt, 0, options + optlen - opt); // End, padding
+    } else if (sacks) {
+        *(options) = 1; // NOP
+        *(options + 1) = 1; // NOP
+        *(options + 2) = 5; // SACK
+        *(options + 3) = (uint8_t) (2 + sacks * 8); // total option length
+        for (int i = 0; i < sacks; i++) {
+            __be32 edge[2] = {htonl(sack[i].start), htonl(sack[i].end)};
+            memcpy(options + 4 + i * 8, edge, 8);
+        }
     }
 
-    // Continue checksum
-    csum = calc_checksum(csum, (uint8_t *) tcp, sizeof(struct tcphdr));
-    csum = calc_checksum(csum, options, (size_t) optlen);
-    csum = calc_checksum(csum, data, datalen);
+    // https://tools.ietf.org/html/rfc1624
+    // The patched fields are zero in the header sum, so only their new values are added,
+    // the data is summed while it is copied
+    uint16_t csum = calc_checksum(header->sum, (uint8_t *) &tcplen, 2);
+    csum = calc_checksum(csum, (uint8_t *) &tcp->seq, sizeof(struct tcphdr) - 4 + optlen);
+    csum = copy_checksum(csum, options + optlen, data, datalen);
     tcp->check = ~csum;
 
-    inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
-              cur->version == 4 ? (const void *) &cur->saddr.ip4 : (const void *) &cur->saddr.ip6,
-              source, sizeof(source));
-    inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
-              cur->version == 4 ? (const void *) &cur->daddr.ip4 : (const void *) &cur->daddr.ip6,
-              dest, sizeof(dest));
+    if (loglevel <= ANDROID_LOG_DEBUG)
+        inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
+                  cur->version == 4 ? (const void *) &cur->daddr.ip4 : (const void *) &cur->daddr.ip6,
+                  dest, sizeof(dest));
 
     // Send packet
+    char flags[20];
+    sprintf(flags, "%s%s%s%s",
+            (tcp->syn ? " SYN" : ""),
+            (tcp->ack ? " ACK" : ""),
+            (tcp->fin ? " FIN" : ""),
+            (tcp->rst ? " RST" : ""));
     log_android(ANDROID_LOG_DEBUG,
-                "TCP sending%s%s%s%s to tun %s/%u seq %u ack %u data %u",
-                (tcp->syn ? " SYN" : ""),
-                (tcp->ack ? " ACK" : ""),
-                (tcp->fin ? " FIN" : ""),
-                (tcp->rst ? " RST" : ""),
+                "TCP sending%s to tun %s/%u seq %u ack %u data %u",
+                flags,
                 dest, ntohs(tcp->dest),
                 ntohl(tcp->seq) - cur->local_start,
                 ntohl(tcp->ack_seq) - cur->remote_start,
                 datalen);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    // Write pcap record
-    if (res >= 0) {
-        if (pcap_file != NULL)
-            write_pcap_rec(buffer, (size_t) res);
-    } else
-        log_android(ANDROID_LOG_ERROR, "TCP write%s%s%s%s data %d error %d: %s",
-                    (tcp->syn ? " SYN" : ""),
-                    (tcp->ack ? " ACK" : ""),
-                    (tcp->fin ? " FIN" : ""),
-                    (tcp->rst ? " RST" : ""),
-                    datalen,
-                    errno, strerror((errno)));
-
-    ng_free(buffer, __FILE__, __LINE__);
+    // The buffer belongs to the tun writer now
+    ssize_t res = write_tun(args, buffer, len);
+    if (res < 0)
+        log_android(ANDROID_LOG_ERROR, "TCP write%s data %d error %d: %s",
+                    flags, datalen, errno, strerror((errno)));
 
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "TCP write %d/%d", res, len);
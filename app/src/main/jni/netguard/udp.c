@@ -19,7 +19,7 @@
 
 #include "netguard.h"
 
-extern FILE *pcap_file;
+extern int loglevel;
 
 int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions) {
     int timeout = (ntohs(u->dest) == 53 ? UDP_TIMEOUT_53 : UDP_TIMEOUT_ANY);
@@ -82,8 +82,9 @@ int check_udp_session(const struct arguments *args, struct ng_session *s,
     return 0;
 }
 
-void check_udp_socket(const struct arguments *args, const struct epoll_event *ev) {
+int check_udp_socket(const struct arguments *args, const struct epoll_event *ev) {
     struct ng_session *s = (struct ng_session *) ev->data.ptr;
+    int received = 0;
 
     // Check socket error
     if (ev->events & EPOLLERR) {
@@ -104,12 +105,14 @@ void check_udp_socket(const struct arguments *args, const struct epoll_event *ev
         if (ev->events & EPOLLIN) {
             s->udp.time = time(NULL);
 
-            uint8_t *buffer = ng_malloc(s->udp.mss, "udp recv");
-            ssize_t bytes = recv(s->socket, buffer, s->udp.mss, 0);
+            uint8_t *buffer = get_packet_buffer(s->udp.mss, "udp recv");
+            ssize_t bytes = recv(s->socket, buffer, s->udp.mss, MSG_DONTWAIT);
+            args->ctx->syscalls++;
             if (bytes < 0) {
                 // Socket error
-                log_android(ANDROID_LOG_WARN, "UDP recv error %d: %s",
-                            errno, strerror(errno));
+                if (errno != EAGAIN)
+                    log_android(ANDROID_LOG_WARN, "UDP recv error %d: %s",
+                                errno, strerror(errno));
 
                 if (errno != EINTR && errno != EAGAIN)
                     s->udp.state = UDP_FINISHING;
@@ -128,6 +131,8 @@ void check_udp_socket(const struct arguments *args, const struct epoll_event *ev
                             bytes, dest, ntohs(s->udp.dest));
 
                 s->udp.received += bytes;
+                args->ctx->packets++;
+                received = 1;
 
                 // Process DNS response
                 if (ntohs(s->udp.dest) == 53)
@@ -142,9 +147,12 @@ void check_udp_socket(const struct arguments *args, const struct epoll_event *ev
                         s->udp.state = UDP_FINISHING;
                 }
             }
-            ng_free(buffer, __FILE__, __LINE__);
+            put_packet_buffer(buffer);
         }
     }
+
+    // Nothing more to read after EAGAIN or when finishing
+    return (received && s->udp.state == UDP_ACTIVE);
 }
 
 int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload) {
@@ -158,24 +166,20 @@ int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint
         return 1;
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_UDP &&
-             cur->udp.version == version &&
-             cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-             (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr &&
-                             cur->udp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args->ctx, IPPROTO_UDP, version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src,
+            udphdr->source,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst,
+            udphdr->dest);
 
     return (cur != NULL);
 }
 
-void block_udp(const struct arguments *args,
-               const uint8_t *pkt, size_t length,
-               const uint8_t *payload,
-               int uid) {
+struct ng_session *block_udp(const struct arguments *args,
+                             const uint8_t *pkt, size_t length,
+                             const uint8_t *payload,
+                             int uid) {
     // Get headers
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -216,15 +220,15 @@ void block_udp(const struct arguments *args,
     s->udp.state = UDP_BLOCKED;
     s->socket = -1;
 
-    s->next = args->ctx->ng_session;
-    args->ctx->ng_session = s;
+    add_session(args->ctx, s);
+    return s;
 }
 
-jboolean handle_udp(const struct arguments *args,
-                    const uint8_t *pkt, size_t length,
-                    const uint8_t *payload,
-                    int uid, struct allowed *redirect,
-                    const int epoll_fd) {
+struct ng_session *handle_udp(const struct arguments *args,
+                              const uint8_t *pkt, size_t length,
+                              const uint8_t *payload,
+                              int uid, struct allowed *redirect,
+                              const int epoll_fd) {
     // Get headers
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -234,16 +238,12 @@ jboolean handle_udp(const struct arguments *args,
     const size_t datalen = length - (data - pkt);
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_UDP &&
-             cur->udp.version == version &&
-             cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-             (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr &&
-                             cur->udp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args->ctx, IPPROTO_UDP, version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src,
+            udphdr->source,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst,
+            udphdr->dest);
 
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
@@ -258,7 +258,7 @@ jboolean handle_udp(const struct arguments *args,
     if (cur != NULL && cur->udp.state != UDP_ACTIVE) {
         log_android(ANDROID_LOG_INFO, "UDP ignore session from %s/%u to %s/%u state %d",
                     source, ntohs(udphdr->source), dest, ntohs(udphdr->dest), cur->udp.state);
-        return 0;
+        return cur;
     }
 
     // Create new session if needed
@@ -295,13 +295,14 @@ jboolean handle_udp(const struct arguments *args,
         s->udp.source = udphdr->source;
         s->udp.dest = udphdr->dest;
         s->udp.state = UDP_ACTIVE;
-        s->next = NULL;
+        init_header_template(&s->udp.header, version, IPPROTO_UDP,
+                             &s->udp.daddr, s->udp.dest, &s->udp.saddr, s->udp.source);
 
         // Open UDP socket
         s->socket = open_udp_socket(args, &s->udp, redirect);
         if (s->socket < 0) {
             ng_free(s, __FILE__, __LINE__);
-            return 0;
+            return NULL;
         }
 
         log_android(ANDROID_LOG_DEBUG, "UDP socket %d", s->socket);
@@ -313,8 +314,7 @@ jboolean handle_udp(const struct arguments *args,
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
             log_android(ANDROID_LOG_ERROR, "epoll add udp error %d: %s", errno, strerror(errno));
 
-        s->next = args->ctx->ng_session;
-        args->ctx->ng_session = s;
+        add_session(args->ctx, s);
 
         cur = s;
     }
@@ -322,7 +322,7 @@ jboolean handle_udp(const struct arguments *args,
     // Check for DHCP (tethering)
     if (ntohs(udphdr->source) == 68 || ntohs(udphdr->dest) == 67) {
         if (check_dhcp(args, &cur->udp, data, datalen) >= 0)
-            return 1;
+            return cur;
     }
 
     log_android(ANDROID_LOG_INFO, "UDP forward from tun %s/%u to %s/%u data %d",
@@ -367,12 +367,12 @@ jboolean handle_udp(const struct arguments *args,
         log_android(ANDROID_LOG_ERROR, "UDP sendto error %d: %s", errno, strerror(errno));
         if (errno != EINTR && errno != EAGAIN) {
             cur->udp.state = UDP_FINISHING;
-            return 0;
+            return cur;
         }
     } else
         cur->udp.sent += datalen;
 
-    return 1;
+    return cur;
 }
 
 int open_udp_socket(const struct arguments *args,
@@ -437,109 +437,55 @@ int open_udp_socket(const struct arguments *args,
 
 ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
                   uint8_t *data, size_t datalen) {
-    size_t len;
-    u_int8_t *buffer;
-    struct udphdr *udp;
-    uint16_t csum;
-    char source[INET6_ADDRSTRLEN + 1];
-    char dest[INET6_ADDRSTRLEN + 1];
-
-    // Build packet
+    const struct header_template *header = &cur->header;
+    char source[INET6_ADDRSTRLEN + 1] = "";
+    char dest[INET6_ADDRSTRLEN + 1] = "";
+
+    // Build packet from the session header
+    size_t len = header->len + datalen;
+    uint8_t *buffer = get_packet_buffer(len, "udp write");
+    memcpy(buffer, header->data, header->len);
+    struct udphdr *udp = (struct udphdr *) (buffer + header->iplen);
+
+    // Patch length
+    udp->len = htons(len - header->iplen);
     if (cur->version == 4) {
-        len = sizeof(struct iphdr) + sizeof(struct udphdr) + datalen;
-        buffer = ng_malloc(len, "udp write4");
         struct iphdr *ip4 = (struct iphdr *) buffer;
-        udp = (struct udphdr *) (buffer + sizeof(struct iphdr));
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr) + sizeof(struct udphdr), data, datalen);
-
-        // Build IP4 header
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
         ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_UDP;
-        ip4->saddr = cur->daddr.ip4;
-        ip4->daddr = cur->saddr.ip4;
-
-        // Calculate IP4 checksum
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-
-        // Calculate UDP4 checksum
-        struct ippseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ippseudo));
-        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
-        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
-        pseudo.ippseudo_p = ip4->protocol;
-        pseudo.ippseudo_len = htons(sizeof(struct udphdr) + datalen);
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
+        ip4->check = ~calc_checksum(header->ip_sum, (uint8_t *) &ip4->tot_len, 2);
     } else {
-        len = sizeof(struct ip6_hdr) + sizeof(struct udphdr) + datalen;
-        buffer = ng_malloc(len, "udp write6");
         struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        udp = (struct udphdr *) (buffer + sizeof(struct ip6_hdr));
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr) + sizeof(struct udphdr), data, datalen);
-
-        // Build IP6 header
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_flow = 0;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_UDP;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
-        memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-
-        // Calculate UDP6 checksum
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = udp->len;
     }
 
-    // Build UDP header
-    memset(udp, 0, sizeof(struct udphdr));
-    udp->source = cur->dest;
-    udp->dest = cur->source;
-    udp->len = htons(sizeof(struct udphdr) + datalen);
-
-    // Continue checksum
-    csum = calc_checksum(csum, (uint8_t *) udp, sizeof(struct udphdr));
-    csum = calc_checksum(csum, data, datalen);
+    // https://tools.ietf.org/html/rfc1624
+    // The length is in both the pseudo header and the UDP header,
+    // the data is summed while it is copied
+    uint16_t csum = calc_checksum(header->sum, (uint8_t *) &udp->len, 2);
+    csum = calc_checksum(csum, (uint8_t *) &udp->len, 2);
+    csum = copy_checksum(csum, buffer + header->len, data, datalen);
     udp->check = ~csum;
 
-    inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
-              (cur->version == 4 ? (const void *) &cur->saddr.ip4 : (const void *) &cur->saddr.ip6),
-              source,
-              sizeof(source));
-    inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
-              (cur->version == 4 ? (const void *) &cur->daddr.ip4 : (const void *) &cur->daddr.ip6),
-              dest,
-              sizeof(dest));
+    if (loglevel <= ANDROID_LOG_DEBUG) {
+        inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
+                  (cur->version == 4 ? (const void *) &cur->saddr.ip4 : (const void *) &cur->saddr.ip6),
+                  source,
+                  sizeof(source));
+        inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
+                  (cur->version == 4 ? (const void *) &cur->daddr.ip4 : (const void *) &cur->daddr.ip6),
+                  dest,
+                  sizeof(dest));
+    }
 
     // Send packet
     log_android(ANDROID_LOG_DEBUG,
                 "UDP sending to tun %d from %s/%u to %s/%u data %u",
                 args->tun, dest, ntohs(cur->dest), source, ntohs(cur->source), len);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    // Write PCAP record
-    if (res >= 0) {
-        if (pcap_file != NULL)
-            write_pcap_rec(buffer, (size_t) res);
-    } else
+    ssize_t res = write_tun(args, buffer, len);
+    if (res < 0)
         log_android(ANDROID_LOG_WARN, "UDP write error %d: %s", errno, strerror(errno));
 
-    ng_free(buffer, __FILE__, __LINE__);
-
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "write %d/%d", res, len);
         return -1;
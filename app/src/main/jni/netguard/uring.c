@@ -0,0 +1,433 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Keeps TUN_URING reads on the tun pending in an io_uring.
+// Completions signal an eventfd, which is monitored by epoll instead of the tun,
+// so every wakeup delivers packets already read into registered buffers
+// and all reads are submitted again with a single io_uring_enter.
+// A second ring per event loop collects the packets written to the tun during a pass
+// and writes them with one io_uring_enter. Tun writes do not block, so they complete
+// inline in submission order, without links which would cancel a batch on one failure.
+// Without io_uring (old kernel, seccomp, SELinux) the tun is read and written as before.
+
+#ifdef __NR_io_uring_setup
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static struct io_uring_sqe *get_sqe(struct tun_ring *ring) {
+    unsigned int index = *ring->sq_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static void commit_sqe(struct tun_ring *ring) {
+    atomic_store_explicit((_Atomic unsigned int *) ring->sq_tail, *ring->sq_tail + 1,
+                          memory_order_release);
+    ring->queued++;
+}
+
+static void queue_read(struct tun_ring *ring, unsigned int slot) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0; // registered tun
+    sqe->addr = (uint64_t) (uintptr_t) (ring->buffers + slot * ring->mtu);
+    sqe->len = (uint32_t) ring->mtu;
+    sqe->buf_index = 0;
+    sqe->user_data = slot;
+    commit_sqe(ring);
+}
+
+static void reap_tun_writes(struct tun_ring *ring) {
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = atomic_load_explicit((_Atomic unsigned int *) ring->cq_tail,
+                                             memory_order_acquire);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned int slot = (unsigned int) cqe->user_data;
+        head++;
+
+        if (cqe->res < 0)
+            log_android(ANDROID_LOG_ERROR, "tun write error %d: %s",
+                        -cqe->res, strerror(-cqe->res));
+        else if ((size_t) cqe->res != ring->iov[slot].iov_len)
+            log_android(ANDROID_LOG_ERROR, "tun write %d/%d",
+                        cqe->res, ring->iov[slot].iov_len);
+
+        put_packet_buffer(ring->pending[slot]);
+        ring->pending[slot] = NULL;
+        ring->free_slots[ring->free_count++] = slot;
+    }
+    atomic_store_explicit((_Atomic unsigned int *) ring->cq_head, head, memory_order_release);
+}
+
+static int submit_ring(const struct arguments *args, struct tun_ring *ring,
+                       unsigned int complete) {
+    while (ring->queued > 0 || complete > 0) {
+        int submitted = uring_enter(ring->fd, ring->queued, complete,
+                                    complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (args != NULL) {
+            if (ring->buffers == NULL)
+                args->ctx->write_syscalls++;
+            else
+                args->ctx->syscalls++;
+        }
+        if (submitted < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EBUSY) {
+                // Retrying at once would spin while the completion queue is full,
+                // completed writes are reaped here and reads by the event loop
+                if (ring->pending != NULL) {
+                    unsigned int free_count = ring->free_count;
+                    reap_tun_writes(ring);
+                    if (ring->free_count != free_count) {
+                        complete = 0;
+                        continue;
+                    }
+                } else if (eventfd_write(ring->event, 1) < 0)
+                    log_android(ANDROID_LOG_ERROR, "eventfd write error %d: %s",
+                                errno, strerror(errno));
+                log_android(ANDROID_LOG_WARN, "io_uring_enter busy queued %u", ring->queued);
+                return 0;
+            }
+            log_android(ANDROID_LOG_ERROR, "io_uring_enter error %d: %s",
+                        errno, strerror(errno));
+            return -1;
+        }
+        ring->queued -= submitted;
+        complete = 0;
+    }
+    return 0;
+}
+
+static struct tun_ring *create_ring(const struct arguments *args, unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    int fd = uring_setup(entries, &params);
+    if (fd < 0) {
+        log_android(ANDROID_LOG_WARN, "io_uring_setup error %d: %s, using epoll",
+                    errno, strerror(errno));
+        return NULL;
+    }
+
+    struct tun_ring *ring = ng_calloc(1, sizeof(struct tun_ring), "tun ring");
+    ring->fd = fd;
+    ring->event = -1;
+    ring->tun_flags = -1;
+    ring->entries = params.sq_entries;
+    ring->mtu = get_mtu();
+    ring->buffers = MAP_FAILED;
+    ring->sq_map = MAP_FAILED;
+    ring->cq_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    // Map queues
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        log_android(ANDROID_LOG_ERROR, "io_uring mmap error %d: %s", errno, strerror(errno));
+        destroy_tun_ring(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_map;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    uint8_t *cq = ring->cq_map;
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    if (uring_register(fd, IORING_REGISTER_FILES, &args->tun, 1) < 0) {
+        log_android(ANDROID_LOG_WARN, "io_uring_register error %d: %s, using epoll",
+                    errno, strerror(errno));
+        destroy_tun_ring(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+struct tun_ring *init_tun_ring(const struct arguments *args) {
+    if (TUN_URING <= 0)
+        return NULL;
+
+    struct tun_ring *ring = create_ring(args, TUN_URING);
+    if (ring == NULL)
+        return NULL;
+
+    // Not heap memory, the kernel might still write into it after closing the ring
+    size_t length = ring->entries * ring->mtu;
+    ring->buffers = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        log_android(ANDROID_LOG_ERROR, "mmap error %d: %s", errno, strerror(errno));
+        destroy_tun_ring(ring);
+        return NULL;
+    }
+
+    struct iovec iov;
+    iov.iov_base = ring->buffers;
+    iov.iov_len = length;
+    if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        log_android(ANDROID_LOG_WARN, "io_uring_register error %d: %s, using epoll",
+                    errno, strerror(errno));
+        destroy_tun_ring(ring);
+        return NULL;
+    }
+
+    ring->event = eventfd(0, EFD_NONBLOCK);
+    if (ring->event < 0 ||
+        uring_register(ring->fd, IORING_REGISTER_EVENTFD, &ring->event, 1) < 0) {
+        log_android(ANDROID_LOG_ERROR, "io_uring eventfd error %d: %s", errno, strerror(errno));
+        destroy_tun_ring(ring);
+        return NULL;
+    }
+
+    // Reads on a non blocking tun would complete with EAGAIN instead of waiting
+    int flags = fcntl(args->tun, F_GETFL, 0);
+    if (flags < 0 || fcntl(args->tun, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        log_android(ANDROID_LOG_ERROR, "fcntl tun ~O_NONBLOCK error %d: %s",
+                    errno, strerror(errno));
+        destroy_tun_ring(ring);
+        return NULL;
+    }
+    ring->tun = args->tun;
+    ring->tun_flags = flags;
+
+    for (unsigned int slot = 0; slot < ring->entries; slot++)
+        queue_read(ring, slot);
+    if (submit_ring(NULL, ring, 0) < 0) {
+        destroy_tun_ring(ring);
+        return NULL;
+    }
+
+    log_android(ANDROID_LOG_WARN, "io_uring tun %d reads %u", args->tun, ring->entries);
+    return ring;
+}
+
+struct tun_ring *init_tun_writer(const struct arguments *args) {
+    if (TUN_WRITES <= 0)
+        return NULL;
+
+    struct tun_ring *ring = create_ring(args, TUN_WRITES);
+    if (ring == NULL)
+        return NULL;
+
+    ring->buffers = NULL;
+    ring->pending = ng_calloc(ring->entries, sizeof(void *), "tun writes");
+    ring->iov = ng_calloc(ring->entries, sizeof(struct iovec), "tun writes");
+    ring->free_slots = ng_calloc(ring->entries, sizeof(unsigned int), "tun writes");
+    for (unsigned int slot = 0; slot < ring->entries; slot++)
+        ring->free_slots[ring->free_count++] = slot;
+
+    log_android(ANDROID_LOG_WARN, "io_uring tun %d writes %u", args->tun, ring->entries);
+    return ring;
+}
+
+int queue_tun_write(const struct arguments *args, struct tun_ring *ring,
+                    uint8_t *buffer, size_t len) {
+    // All slots in use, wait for the oldest writes
+    if (ring->free_count == 0) {
+        if (flush_tun_writes(args, ring) < 0)
+            return -1;
+        if (ring->free_count == 0) {
+            if (submit_ring(args, ring, 1) < 0)
+                return -1;
+            reap_tun_writes(ring);
+        }
+        if (ring->free_count == 0)
+            return -1; // written directly
+    }
+
+    unsigned int slot = ring->free_slots[--ring->free_count];
+    ring->pending[slot] = buffer;
+    ring->iov[slot].iov_base = buffer;
+    ring->iov[slot].iov_len = len;
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0; // registered tun
+    sqe->addr = (uint64_t) (uintptr_t) &ring->iov[slot];
+    sqe->len = 1;
+    sqe->user_data = slot;
+    commit_sqe(ring);
+
+    return 0;
+}
+
+int flush_tun_writes(const struct arguments *args, struct tun_ring *ring) {
+    if (ring->queued > 0 && submit_ring(args, ring, 0) < 0)
+        return -1;
+    reap_tun_writes(ring);
+    return 0;
+}
+
+void destroy_tun_ring(struct tun_ring *ring) {
+    if (ring == NULL)
+        return;
+
+    // Write what is left
+    if (ring->pending != NULL) {
+        flush_tun_writes(NULL, ring);
+        while (ring->free_count < ring->entries) {
+            unsigned int free_count = ring->free_count;
+            if (submit_ring(NULL, ring, 1) < 0)
+                break;
+            reap_tun_writes(ring);
+            if (ring->free_count == free_count)
+                break;
+        }
+    }
+
+    // Closing the ring cancels pending reads
+    if (close(ring->fd))
+        log_android(ANDROID_LOG_ERROR, "io_uring close error %d: %s", errno, strerror(errno));
+    if (ring->event >= 0 && close(ring->event))
+        log_android(ANDROID_LOG_ERROR, "eventfd close error %d: %s", errno, strerror(errno));
+
+    // Reading the tun directly again needs it non blocking, or draining it would hang
+    if (ring->tun_flags >= 0 && fcntl(ring->tun, F_SETFL, ring->tun_flags) < 0)
+        log_android(ANDROID_LOG_ERROR, "fcntl tun O_NONBLOCK error %d: %s",
+                    errno, strerror(errno));
+
+    if (ring->buffers != MAP_FAILED && ring->buffers != NULL)
+        munmap(ring->buffers, ring->entries * ring->mtu);
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != MAP_FAILED)
+        munmap(ring->cq_map, ring->cq_size);
+    if (ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_size);
+
+    if (ring->pending != NULL) {
+        ng_free(ring->pending, __FILE__, __LINE__);
+        ng_free(ring->iov, __FILE__, __LINE__);
+        ng_free(ring->free_slots, __FILE__, __LINE__);
+    }
+
+    ng_free(ring, __FILE__, __LINE__);
+}
+
+int check_tun_ring(const struct arguments *args, struct tun_ring *ring,
+                   const int epoll_fd,
+                   int sessions, int maxsessions) {
+    // Reset the eventfd before reaping, later completions signal it again
+    eventfd_t count;
+    if (eventfd_read(ring->event, &count) < 0 && errno != EAGAIN)
+        log_android(ANDROID_LOG_WARN, "eventfd read error %d: %s", errno, strerror(errno));
+    args->ctx->syscalls++;
+
+    // Every read is queued again only after reaping, which bounds this loop
+    int err = 0;
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = atomic_load_explicit((_Atomic unsigned int *) ring->cq_tail,
+                                             memory_order_acquire);
+    while (head != tail && !err && !args->ctx->stopping) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned int slot = (unsigned int) cqe->user_data;
+        int res = cqe->res;
+        head++;
+
+        if (res > 0) {
+            args->ctx->packets++;
+            if (check_tun_packet(args, ring->buffers + slot * ring->mtu, (size_t) res,
+                                 epoll_fd, sessions, maxsessions) < 0)
+                err = -1;
+        } else if (res == 0) {
+            log_android(ANDROID_LOG_ERROR, "tun %d empty read", args->tun);
+            report_exit(args, "tun %d empty read", args->tun);
+            err = -1;
+        } else if (res != -EINTR && res != -EAGAIN) {
+            log_android(ANDROID_LOG_ERROR, "tun %d read error %d: %s",
+                        args->tun, -res, strerror(-res));
+            report_exit(args, "tun %d read error %d: %s", args->tun, -res, strerror(-res));
+            err = -1;
+        }
+
+        if (!err)
+            queue_read(ring, slot);
+    }
+    atomic_store_explicit((_Atomic unsigned int *) ring->cq_head, head, memory_order_release);
+
+    if (!err && submit_ring(args, ring, 0) < 0)
+        err = -1;
+
+    return err;
+}
+
+#else
+
+struct tun_ring *init_tun_ring(const struct arguments *args) {
+    return NULL;
+}
+
+void destroy_tun_ring(struct tun_ring *ring) {
+}
+
+struct tun_ring *init_tun_writer(const struct arguments *args) {
+    return NULL;
+}
+
+int queue_tun_write(const struct arguments *args, struct tun_ring *ring,
+                    uint8_t *buffer, size_t len) {
+    return -1;
+}
+
+int flush_tun_writes(const struct arguments *args, struct tun_ring *ring) {
+    return -1;
+}
+
+int check_tun_ring(const struct arguments *args, struct tun_ring *ring,
+                   const int epoll_fd,
+                   int sessions, int maxsessions) {
+    return -1;
+}
+
+#endif
@@ -21,25 +21,6 @@
 
 extern int loglevel;
 
-uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length) {
-    register uint32_t sum = start;
-    register uint16_t *buf = (uint16_t *) buffer;
-    register size_t len = length;
-
-    while (len > 1) {
-        sum += *buf++;
-        len -= 2;
-    }
-
-    if (len > 0)
-        sum += *((uint8_t *) buf);
-
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-
-    return (uint16_t) sum;
-}
-
 int compare_u32(uint32_t s1, uint32_t s2) {
     // https://tools.ietf.org/html/rfc1982
     if (s1 == s2)